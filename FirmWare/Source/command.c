@@ -22,6 +22,7 @@
 #include "data.h"
 #include "message.h"
 #include "version.h"
+#include "journal.h"
 
 //*************************************************************************************************
 // Внешние переменные
@@ -91,12 +92,15 @@ static void CmndStat( uint8_t cnt_par, char *param );
 static void CmndConfig( uint8_t cnt_par, char *param );
 static void CmndZigBee( uint8_t cnt_par, char *param );
 static void CmndZbDev( uint8_t cnt_par, char *param );
+static void CmndJournal( uint8_t cnt_par, char *param );
 static void CmndVersion( uint8_t cnt_par, char *param );
 //#ifdef DEBUG_TARGET
 static void CmndTask( uint8_t cnt_par, char *param );
 static void CmndFlash( uint8_t cnt_par, char *param );
 static void CmndReset( uint8_t cnt_par, char *param );
 //#endif
+static void CmndSend( ZBTypePack type, uint16_t dev_numb, uint8_t count_log, ValveCtrlMode cold, ValveCtrlMode hot, uint16_t time_answ, ZBTypePack cache );
+static void CmndSendDone( ZBErrorState state, void *arg );
 
 //*************************************************************************************************
 // Локальные переменные
@@ -111,7 +115,11 @@ static const char *help = {
     "valve num_dev [cold/hot opn/cls] - Drive control\r\n"
     "water num_dev [N]                - Water flow indication\r\n"
     "wtlog num_dev num_logs           - Log data\r\n"
+    "wtlog num_dev num_logs win       - Log data, window transfer\r\n"
+    "wtlog num_dev num_logs batch     - Log data, several records per packet\r\n"
+    "wtlog num_dev num_logs new       - Log data received after the last record\r\n"
     "dev [N]                          - Device list [stat]\r\n"
+    "jrn                              - Journal harvester status\r\n"
     "\r\n"
     "stat                             - Statistics.\r\n"
     "task                             - List task statuses, time statistics.\r\n"
@@ -125,6 +133,13 @@ static const char *help = {
     "config netkey XXXX....           - Network key (HEX format without 0x).\r\n"
     "config devnumb 0x0001 - 0xFFFF   - Device number on the network (HEX format without 0x).\r\n"
     "config gate 0x0000- 0xFFF8       - Gateway address (HEX format without 0x).\r\n"
+    #if RECV_MODE_DMA == 0
+    "config zbgap 1-32                - ZigBee end of frame gap (bytes).\r\n"
+    #endif
+    "config zbrate ctrl|query|bulk|bcast 1-10000 1-100\r\n"
+    "                                 - ZigBee transmit rate limit (bytes/sec, frames/sec).\r\n"
+    "config jrnper 0-3600             - Journal harvester period (sec), 0 - off.\r\n"
+    "config cache 0-3600              - Max age of cached device data (sec), 0 - off.\r\n"
     "version                          - Displays the version number and date.\r\n"
     #ifdef DEBUG_TARGET              
     "reset                            - Reset controller.\r\n"
@@ -147,6 +162,7 @@ static const CMD cmd[] = {
     { "config",         CmndConfig },
     { "zb",             CmndZigBee },
     { "dev",            CmndZbDev },
+    { "jrn",            CmndJournal },
     { "version",        CmndVersion },
     { "task",           CmndTask },
     { "flash",          CmndFlash },
@@ -264,6 +280,7 @@ static void CmndConfig( uint8_t cnt_par, char *param ) {
 
     char *ptr;
     uint8_t error, ind, bin[sizeof( config.net_key )];
+    uint32_t frames;
     UARTSpeed uart_speed;
     bool change = false;
     union {
@@ -335,6 +352,54 @@ static void CmndConfig( uint8_t cnt_par, char *param ) {
            }
         else UartSendStr( (char *)msg_err_param );
        }
+    //пауза окончания пакета при приеме от ZigBee модуля, при приеме по DMA окончание
+    //пакета определяется аппаратно (IDLE), параметр не используется
+    if ( cnt_par == 3 && !strcasecmp( GetParamVal( IND_PARAM1 ), "zbgap" ) ) {
+        #if RECV_MODE_DMA == 0
+        value.val_uint8 = atoi( GetParamVal( IND_PARAM2 ) );
+        if ( value.val_uint8 && value.val_uint8 <= ZB_GAP_MAX ) {
+            change = true;
+            config.zb_gap = value.val_uint8;
+            ZBRecvTimeout();
+           }
+        else UartSendStr( (char *)msg_err_param );
+        #else
+        UartSendStr( (char *)msg_zbgap_idle );
+        #endif
+       }
+    //ограничение скорости передачи ZigBee по классу запросов
+    if ( cnt_par == 5 && !strcasecmp( GetParamVal( IND_PARAM1 ), "zbrate" ) ) {
+        for ( ind = 0; ind < ZB_RATE_CNT; ind++ ) {
+            if ( !strcasecmp( GetParamVal( IND_PARAM2 ), ZBRateDesc( ind ) ) )
+                break;
+           }
+        value.val_uint32 = atol( GetParamVal( IND_PARAM3 ) );
+        frames = atol( GetParamVal( IND_PARAM4 ) );
+        if ( ind < ZB_RATE_CNT && value.val_uint32 && value.val_uint32 <= ZB_RATE_BYTES_MAX && frames && frames <= ZB_RATE_FRAMES_MAX ) {
+            change = true;
+            config.zb_rate_bytes[ind] = value.val_uint32;
+            config.zb_rate_frames[ind] = frames;
+           }
+        else UartSendStr( (char *)msg_err_param );
+       }
+    //период фонового сбора журнальных данных
+    if ( cnt_par == 3 && !strcasecmp( GetParamVal( IND_PARAM1 ), "jrnper" ) ) {
+        value.val_uint32 = atol( GetParamVal( IND_PARAM2 ) );
+        if ( value.val_uint32 <= JRN_PERIOD_MAX ) {
+            change = true;
+            config.jrn_period = value.val_uint32;
+           }
+        else UartSendStr( (char *)msg_err_param );
+       }
+    //максимальный возраст данных уст-ва в кэше
+    if ( cnt_par == 3 && !strcasecmp( GetParamVal( IND_PARAM1 ), "cache" ) ) {
+        value.val_uint32 = atol( GetParamVal( IND_PARAM2 ) );
+        if ( value.val_uint32 <= CACHE_AGE_MAX ) {
+            change = true;
+            config.cache_age = value.val_uint32;
+           }
+        else UartSendStr( (char *)msg_err_param );
+       }
     //сохранение параметров
     if ( cnt_par == 2 && !strcasecmp( GetParamVal( IND_PARAM1 ), "save" ) ) {
         UartSendStr( (char *)msg_save );
@@ -366,6 +431,18 @@ static void CmndConfig( uint8_t cnt_par, char *param ) {
     UartSendStr( buffer );
     sprintf( buffer, "Gateway address: .................... 0x%04X\r\n", config.addr_gate );
     UartSendStr( buffer );
+    #if RECV_MODE_DMA == 0
+    sprintf( buffer, "ZigBee end of frame gap: ............ %u bytes (%u us)\r\n", config.zb_gap, ZBRecvGap() );
+    UartSendStr( buffer );
+    #endif
+    for ( ind = 0; ind < ZB_RATE_CNT; ind++ ) {
+        sprintf( buffer, "ZigBee rate limit %-5s: ............ %u bytes/sec, %u frames/sec\r\n", ZBRateDesc( ind ), ZBRateBytes( ind ), ZBRateFrames( ind ) );
+        UartSendStr( buffer );
+       }
+    sprintf( buffer, "Journal harvester period: ........... %u sec\r\n", config.jrn_period );
+    UartSendStr( buffer );
+    sprintf( buffer, "Device data cache max age: .......... %u sec\r\n", config.cache_age );
+    UartSendStr( buffer );
     if ( change == true ) {
         //сохранение параметров
         UartSendStr( (char *)msg_save );
@@ -384,21 +461,12 @@ static void CmndConfig( uint8_t cnt_par, char *param ) {
 //*************************************************************************************************
 static void CmndWater( uint8_t cnt_par, char *param ) {
 
-    uint16_t dev_numb, net_addr;
-    uint8_t *data, len;
-    ZBErrorState state;
+    uint16_t dev_numb;
 
     if ( cnt_par == 2 ) {
         //вывод состояния давления и расхода воды
         dev_numb = atoi( GetParamVal( IND_PARAM1 ) );
-        data = CreatePack( ZB_PACK_REQ_DATA, dev_numb, &net_addr, 0, VALVE_CTRL_NOTHING, VALVE_CTRL_NOTHING, &len );
-        if ( data == NULL ) {
-            UartSendStr( (char *)msg_err_dev );
-            return;
-           }
-        state = ZBSendPack1( data, len, net_addr, TIME_WAIT_ANSWER );
-        sprintf( buffer, "%s %s\r\n", (char *)msg_send_res, ZBErrDesc( state ) );
-        UartSendStr( buffer );
+        CmndSend( ZB_PACK_REQ_DATA, dev_numb, 0, VALVE_CTRL_NOTHING, VALVE_CTRL_NOTHING, TIME_WAIT_RTO, ZB_PACK_DATA );
         return;
        }
     UartSendStr( (char *)msg_err_param );
@@ -412,22 +480,35 @@ static void CmndWater( uint8_t cnt_par, char *param ) {
 //*************************************************************************************************
 static void CmndWtLog( uint8_t cnt_par, char *param ) {
 
-    uint16_t dev_numb, net_addr;
-    uint8_t *data, len, dev_log;
-    ZBErrorState state;
+    uint16_t dev_numb;
+    uint8_t dev_log;
+    ZBTypePack type = ZB_PACK_REQ_DATA;
 
+    if ( cnt_par == 4 && !strcasecmp( GetParamVal( IND_PARAM3 ), "win" ) ) {
+        //запрос данных из журнала с передачей окном
+        type = ZB_PACK_REQ_WLOG;
+        cnt_par = 3;
+       }
+    if ( cnt_par == 4 && !strcasecmp( GetParamVal( IND_PARAM3 ), "batch" ) ) {
+        //запрос данных из журнала пакетами из нескольких записей
+        type = ZB_PACK_REQ_BATCH;
+        cnt_par = 3;
+       }
+    if ( cnt_par == 4 && !strcasecmp( GetParamVal( IND_PARAM3 ), "new" ) ) {
+        //запрос данных из журнала, записанных после последней полученной записи
+        type = ZB_PACK_REQ_SINCE;
+        cnt_par = 3;
+       }
     if ( cnt_par == 3 ) {
         //запрос данных из журнала
         dev_numb = atoi( GetParamVal( IND_PARAM1 ) );
         dev_log = atoi( GetParamVal( IND_PARAM2 ) );
-        data = CreatePack( ZB_PACK_REQ_DATA, dev_numb, &net_addr, dev_log, VALVE_CTRL_NOTHING, VALVE_CTRL_NOTHING, &len );
-        if ( data == NULL ) {
-            UartSendStr( (char *)msg_err_dev );
+        //новый запрос передачи окном не прерывает выполняемую передачу
+        if ( type == ZB_PACK_REQ_WLOG && WLogBusy( dev_numb ) == true ) {
+            UartSendStr( (char *)msg_wlog_busy );
             return;
            }
-        state = ZBSendPack1( data, len, net_addr, TIME_WAIT_ANSWER );
-        sprintf( buffer, "%s %s\r\n", (char *)msg_send_res, ZBErrDesc( state ) );
-        UartSendStr( buffer );
+        CmndSend( type, dev_numb, dev_log, VALVE_CTRL_NOTHING, VALVE_CTRL_NOTHING, TIME_WAIT_RTO, ZB_PACK_UNDEF );
         return;
        }
     UartSendStr( (char *)msg_err_param );
@@ -442,9 +523,7 @@ static void CmndWtLog( uint8_t cnt_par, char *param ) {
 static void CmndValve( uint8_t cnt_par, char *param ) {
 
     int opn, cls;
-    uint16_t dev_numb, net_addr;
-    uint8_t *data, len;
-    ZBErrorState state;
+    uint16_t dev_numb;
     ValveCtrlMode cold = VALVE_CTRL_NOTHING;
     ValveCtrlMode hot  = VALVE_CTRL_NOTHING;
     
@@ -457,14 +536,7 @@ static void CmndValve( uint8_t cnt_par, char *param ) {
             cold = VALVE_CTRL_OPEN;
         if ( opn && !cls )
             cold = VALVE_CTRL_CLOSE;
-        data = CreatePack( ZB_PACK_CTRL_VALVE, dev_numb, &net_addr, 0, cold, hot, &len );
-        if ( data == NULL ) {
-            UartSendStr( (char *)msg_err_dev );
-            return;
-           }
-        state = ZBSendPack1( data, len, net_addr, TIME_NO_WAIT );
-        sprintf( buffer, "%s %s\r\n", (char *)msg_send_res, ZBErrDesc( state ) );
-        UartSendStr( buffer );
+        CmndSend( ZB_PACK_CTRL_VALVE, dev_numb, 0, cold, hot, TIME_NO_WAIT, ZB_PACK_UNDEF );
         return;
        }
     if ( cnt_par == 4 && !strcasecmp( GetParamVal( IND_PARAM2 ), "hot" ) ) {
@@ -476,27 +548,13 @@ static void CmndValve( uint8_t cnt_par, char *param ) {
             hot = VALVE_CTRL_OPEN;
         if ( opn && !cls )
             hot = VALVE_CTRL_CLOSE;
-        data = CreatePack( ZB_PACK_CTRL_VALVE, dev_numb, &net_addr, 0, cold, hot, &len );
-        if ( data == NULL ) {
-            UartSendStr( (char *)msg_err_dev );
-            return;
-           }
-        state = ZBSendPack1( data, len, net_addr, TIME_NO_WAIT );
-        sprintf( buffer, "%s %s\r\n", (char *)msg_send_res, ZBErrDesc( state ) );
-        UartSendStr( buffer );
+        CmndSend( ZB_PACK_CTRL_VALVE, dev_numb, 0, cold, hot, TIME_NO_WAIT, ZB_PACK_UNDEF );
         return;
        }
     if ( cnt_par == 2 ) {
         //вывод информации о состоянии электроприводов 
         dev_numb = atoi( GetParamVal( IND_PARAM1 ) );
-        data = CreatePack( ZB_PACK_REQ_VALVE, dev_numb, &net_addr, 0, cold, hot, &len );
-        if ( data == NULL ) {
-            UartSendStr( (char *)msg_err_dev );
-            return;
-           }
-        state = ZBSendPack1( data, len, net_addr, TIME_WAIT_ANSWER );
-        sprintf( buffer, "%s %s\r\n", (char *)msg_send_res, ZBErrDesc( state ) );
-        UartSendStr( buffer );
+        CmndSend( ZB_PACK_REQ_VALVE, dev_numb, 0, cold, hot, TIME_WAIT_RTO, ZB_PACK_VALVE );
         return;
        }
     UartSendStr( (char *)msg_err_param );
@@ -574,9 +632,7 @@ static void CmndDateTime( uint8_t cnt_par, char *param ) {
 //*************************************************************************************************
 static void CmndZbDev( uint8_t cnt_par, char *param ) {
 
-    uint16_t dev_numb, net_addr;
-    uint8_t *data, len;
-    ZBErrorState state;
+    uint16_t dev_numb;
 
     if ( cnt_par == 1 ) {
         //вывод списка уст-в
@@ -586,15 +642,22 @@ static void CmndZbDev( uint8_t cnt_par, char *param ) {
     if ( cnt_par == 2 ) {
         //вывод состояния уст-ва
         dev_numb = atoi( GetParamVal( IND_PARAM1 ) );
-        data = CreatePack( ZB_PACK_REQ_STATE, dev_numb, &net_addr, 0, VALVE_CTRL_NOTHING, VALVE_CTRL_NOTHING, &len );
-        if ( data == NULL ) {
-            sprintf( buffer, "Pointer is NULL.\r\n" );
-            UartSendStr( buffer );
-            return;
-           }
-        state = ZBSendPack1( data, len, net_addr, TIME_WAIT_ANSWER );
-        sprintf( buffer, "%s %s\r\n", (char *)msg_send_res, ZBErrDesc( state ) );
-        UartSendStr( buffer );
+        CmndSend( ZB_PACK_REQ_STATE, dev_numb, 0, VALVE_CTRL_NOTHING, VALVE_CTRL_NOTHING, TIME_WAIT_RTO, ZB_PACK_STATE );
+        return;
+       }
+    UartSendStr( (char *)msg_err_param );
+ }
+
+//*************************************************************************************************
+// Вывод состояния фонового сбора журнальных данных терминалов
+//-------------------------------------------------------------------------------------------------
+// uint8_t cnt_par - кол-во параметров
+// char *param     - указатель на список параметров
+//*************************************************************************************************
+static void CmndJournal( uint8_t cnt_par, char *param ) {
+
+    if ( cnt_par == 1 ) {
+        JournalStat();
         return;
        }
     UartSendStr( (char *)msg_err_param );
@@ -622,6 +685,12 @@ static void CmndStat( uint8_t cnt_par, char *param ) {
         sprintf( buffer, "%s\r\n", ZBErrCntDesc( (ZBErrorState)i, str ) );
         UartSendStr( buffer );
        }
+    //дополнительные счетчики: прием пакетов, повторы и классы передачи, ограничение скорости,
+    //объединение запросов, подтверждения журнальных данных
+    for ( i = 0; i < ZB_STAT_CNT; i++ ) {
+        sprintf( buffer, "%s\r\n", ZBStatDesc( (ZBStatId)i, str ) );
+        UartSendStr( buffer );
+       }
  }
 
 //*************************************************************************************************
@@ -886,3 +955,47 @@ static ErrorStatus HexToBin( char *ptr, uint8_t *bin ) {
        }
     return ERROR;
  }
+
+//*************************************************************************************************
+// Передача запроса уст-ву. Пакет формируется в буфере передачи, запрос выполняется 
+// асинхронно, результат выводится в CmndSendDone(). Если данные того же типа, что и ответ
+// на запрос, получены от уст-ва не ранее config.cache_age, они выводятся из кэша без запроса.
+//-------------------------------------------------------------------------------------------------
+// ZBTypePack type    - тип пакета запроса
+// uint16_t dev_numb  - номер уст-ва
+// uint8_t count_log  - кол-во запрашиваемых записей журнала
+// ValveCtrlMode cold - управление электроприводом холодной воды
+// ValveCtrlMode hot  - управление электроприводом горячей воды
+// uint16_t time_answ - время ожидания ответа (msec), TIME_NO_WAIT - без ожидания ответа,
+//                      TIME_WAIT_RTO - по оценке времени ответа уст-ва
+// ZBTypePack cache   - тип данных ответа для вывода из кэша, ZB_PACK_UNDEF - без кэша
+//*************************************************************************************************
+static void CmndSend( ZBTypePack type, uint16_t dev_numb, uint8_t count_log, ValveCtrlMode cold, ValveCtrlMode hot, uint16_t time_answ, ZBTypePack cache ) {
+
+    ZBErrorState state;
+
+    if ( DevCacheOut( dev_numb, cache ) == true )
+        return;
+    state = ZBSendCreate( type, dev_numb, count_log, cold, hot, time_answ, CmndSendDone, NULL );
+    if ( state == ZB_ERROR_NUMB ) {
+        UartSendStr( (char *)msg_err_dev );
+        return;
+       }
+    if ( state != ZB_ERROR_OK )
+        CmndSendDone( state, NULL );
+ }
+
+//*************************************************************************************************
+// Функция завершения асинхронного запроса к уст-ву, вывод результата выполнения запроса.
+// Вызов выполняется из задачи обмена с ZigBee модулем.
+//-------------------------------------------------------------------------------------------------
+// ZBErrorState state - результат выполнения запроса
+// void *arg          - не используется
+//*************************************************************************************************
+static void CmndSendDone( ZBErrorState state, void *arg ) {
+
+    static char str[60];
+
+    sprintf( str, "%s %s\r\n", (char *)msg_send_res, ZBErrDesc( state ) );
+    UartSendStr( str );
+ }
@@ -14,6 +14,7 @@
 #include "uart.h"
 #include "crc16.h"
 #include "config.h"
+#include "zigbee.h"
 #include "events.h"
 #include "parse.h"
 
@@ -75,6 +76,12 @@ void ConfigInit( void ) {
         memcpy( config.net_key, key, sizeof( config.net_key ) ); //ключ шифрования
         config.dev_numb = 0x0001;                   //адрес уст-ва в сети (логический номер уст-ва)
         config.addr_gate = 0x0000;                  //адрес шлюза с сети
+        config.zb_gap = ZB_GAP_DEFAULT;             //пауза окончания пакета от ZigBee модуля
+        //ограничение скорости передачи ZigBee - значения по умолчанию
+        memset( config.zb_rate_bytes, 0x00, sizeof( config.zb_rate_bytes ) );
+        memset( config.zb_rate_frames, 0x00, sizeof( config.zb_rate_frames ) );
+        config.jrn_period = 0;                      //фоновый сбор журнальных данных выключен
+        config.cache_age = CACHE_AGE_DEFAULT;       //максимальный возраст данных уст-ва
         flash_read = ERROR;
        }
     else {
@@ -96,15 +103,30 @@ void ConfigInit( void ) {
 //*************************************************************************************************
 uint8_t ConfigSave( void ) {
 
-    uint8_t dw, dw_cnt;
-    uint32_t err_addr, *ptr_glb, ptr_flash;
-    HAL_StatusTypeDef stat_flash;
-    FLASH_EraseInitTypeDef erase;
-    
     memset( (uint8_t *)&flash_data, 0x00, sizeof( flash_data ) );
     memcpy( (uint8_t *)&flash_data, (uint8_t *)&config, sizeof( config ) );
     //расчет КС блока данных
     flash_data.crc = CalcCRC16( (uint8_t *)&flash_data, sizeof( flash_data.data ) );
+    return FlashWrite( FLASH_DATA_ADDRESS, (uint32_t *)&flash_data, sizeof( flash_data ), true );
+ }
+
+//*************************************************************************************************
+// Запись блока данных в страницу FLASH памяти, страница предварительно стирается или блок
+// данных дописывается в стертую ранее область страницы (без стирания)
+//-------------------------------------------------------------------------------------------------
+// uint32_t addr  - адрес записи, при стирании - адрес начала страницы FLASH памяти
+// uint32_t *data - указатель на блок данных
+// uint16_t size  - размер блока данных (кратный 4 байтам, не более размера страницы)
+// bool erase     - стереть страницу перед записью
+// return         - код ошибки (набор ошибок) 
+//*************************************************************************************************
+uint8_t FlashWrite( uint32_t addr, uint32_t *data, uint16_t size, bool erase ) {
+
+    uint16_t dw, dw_cnt;
+    uint32_t err_addr, ptr_flash;
+    HAL_StatusTypeDef stat_flash;
+    FLASH_EraseInitTypeDef page;
+    
     osKernelLock(); //начало критической секция кода
     //разблокируем память
     stat_flash = HAL_FLASH_Unlock();
@@ -113,21 +135,22 @@ uint8_t ConfigSave( void ) {
         return ERR_FLASH_UNLOCK | stat_flash;
        }
     //стирание одной страницы памяти
-    erase.TypeErase = FLASH_TYPEERASE_PAGES;
-    erase.Banks = FLASH_BANK_1;
-    erase.PageAddress = FLASH_DATA_ADDRESS;
-    erase.NbPages = 1;
-    stat_flash = HAL_FLASHEx_Erase( &erase, &err_addr );
-    if ( stat_flash != HAL_OK ) {
-        osKernelUnlock(); //окончание критической секция кода
-        return ERR_FLASH_ERASE | stat_flash;
+    if ( erase == true ) {
+        page.TypeErase = FLASH_TYPEERASE_PAGES;
+        page.Banks = FLASH_BANK_1;
+        page.PageAddress = addr;
+        page.NbPages = 1;
+        stat_flash = HAL_FLASHEx_Erase( &page, &err_addr );
+        if ( stat_flash != HAL_OK ) {
+            osKernelUnlock(); //окончание критической секция кода
+            return ERR_FLASH_ERASE | stat_flash;
+           }
        }
     //запись в FLASH только по 4 байта
-    ptr_glb = (uint32_t *)&flash_data;
-    ptr_flash = FLASH_DATA_ADDRESS;
-    dw_cnt = sizeof( flash_data )/sizeof( uint32_t );
-    for ( dw = 0; dw < dw_cnt; dw++, ptr_glb++, ptr_flash += 4 ) {
-        stat_flash = HAL_FLASH_Program( FLASH_TYPEPROGRAM_WORD, ptr_flash, *ptr_glb );    
+    ptr_flash = addr;
+    dw_cnt = size/sizeof( uint32_t );
+    for ( dw = 0; dw < dw_cnt; dw++, data++, ptr_flash += 4 ) {
+        stat_flash = HAL_FLASH_Program( FLASH_TYPEPROGRAM_WORD, ptr_flash, *data );    
         if ( stat_flash != HAL_OK ) {
             osKernelUnlock(); //окончание критической секция кода
             return ERR_FLASH_PROGRAMM | stat_flash;
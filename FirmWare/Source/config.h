@@ -10,12 +10,21 @@
 #define FLASH_DATA_ADDRESS      0x0803F800      //адрес для хранения параметров
                                                 //последняя страница FLASH памяти (2Kb)
                                                 //PM0075.pdf page: 8, table 4
+#define FLASH_CURSOR_ADDRESS    0x0803F000      //адрес для хранения позиций сбора журнальных
+                                                //данных терминалов, предпоследняя страница (2Kb)
+#define FLASH_PAGE_BYTES        0x800           //размер страницы FLASH памяти
 //маски ошибок при сохранении параметров
 #define ERR_FLASH_UNLOCK        0x10            //разблокировка памяти
 #define ERR_FLASH_ERASE         0x20            //стирание FLASH
 #define ERR_FLASH_PROGRAMM      0x40            //сохранение параметров
 #define ERR_FLASH_LOCK          0x80            //блокировка памяти
 
+#define CACHE_AGE_DEFAULT       30              //максимальный возраст данных уст-ва по умолчанию (сек)
+#define CACHE_AGE_MAX           3600            //максимальное значение возраста данных уст-ва (сек)
+
+#define ZB_RATE_CNT             4               //кол-во ограничителей скорости передачи ZigBee:
+                                                //классы запросов + широковещательная передача
+
 #pragma pack( push, 1 )
 
 //*************************************************************************************************
@@ -28,6 +37,17 @@ typedef struct {
     uint8_t     net_key[16];                    //ключ шифрования
     uint16_t    dev_numb;                       //номер уст-ва в сети
     uint16_t    addr_gate;                      //адрес шлюза с сети
+    uint8_t     zb_gap;                         //пауза в приеме от ZigBee модуля для определения 
+                                                //окончания пакета (в длительностях передачи байта)
+    uint16_t    zb_rate_bytes[ZB_RATE_CNT];     //ограничение скорости передачи ZigBee (байт/сек)
+                                                //"0" - значение по умолчанию
+    uint8_t     zb_rate_frames[ZB_RATE_CNT];    //ограничение скорости передачи ZigBee (пакетов/сек)
+                                                //"0" - значение по умолчанию
+    uint16_t    jrn_period;                     //период фонового сбора журнальных данных (сек)
+                                                //"0" - сбор выключен
+    uint16_t    cache_age;                      //максимальный возраст данных уст-ва, при котором
+                                                //запрос выполняется без передачи по ZigBee (сек)
+                                                //"0" - данные всегда запрашиваются у уст-ва
  } CONFIG;
 
 //структура хранения блока параметров в FLASH памяти
@@ -43,6 +63,7 @@ typedef struct {
 //*************************************************************************************************
 void ConfigInit( void );
 uint8_t ConfigSave( void );
+uint8_t FlashWrite( uint32_t addr, uint32_t *data, uint16_t size, bool erase );
 uint8_t ResetSrc( void );
 char *FlashReadStat( void );
 char *ResetSrcDesc( uint8_t flags );
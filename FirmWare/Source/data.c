@@ -8,6 +8,7 @@
 //*************************************************************************************************
 
 #include <string.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include <stdio.h>
 
@@ -20,6 +21,7 @@
 #include "crc16.h"
 #include "xtime.h"
 #include "zigbee.h"
+#include "journal.h"
 #include "message.h"
 
 //*************************************************************************************************
@@ -31,157 +33,287 @@ extern ZB_CONFIG zb_cfg;
 //*************************************************************************************************
 // Локальные константы
 //*************************************************************************************************
-#define DEV_LIST_MAX            10          //максимальное кол-во устройств
 #define MAX_TIME_UPDATE         120         //максимальное время ожидания периодической (состояния)
                                             //информации от уст-ва, если в течении этого времения 
                                             //информации от уст-ва не приходит - уст-во удалется 
                                             //из списка (сек)
+#define RTO_MIN                 200         //минимальное время ожидания ответа уст-ва (msec)
+#define RTO_MAX                 10000       //максимальное время ожидания ответа уст-ва (msec)
+#define CACHE_TYPE_CNT          4           //кол-во типов пакетов, сохраняемых в кэше уст-ва
+#define WLOG_REC_TAIL           ( offsetof( PACK_DATA, crc ) - offsetof( PACK_DATA, pressr_cold ) )
+                                            //размер неизменяемой части разностной записи 
+                                            //ZB_PACK_WLOG_BATCH: давление, состояния
+#define RETRY_BUDGET            6           //лимит повторных передач уст-ву: каждый повтор 
+                                            //уменьшает лимит, каждый полученный ответ - 
+                                            //восстанавливает (на 1)
 
 //*************************************************************************************************
-// Локальные переменные
+// Локальные типы данных
 //*************************************************************************************************
-static char str[80];
-
-static PACK_STATE       pack_state;
-static PACK_DATA        pack_data;
-static PACK_VALVE       pack_valve;
-static PACK_LEAKS       pack_leaks;
+//Параметры формирования исходящего пакета
+typedef struct {
+    uint16_t        dev_numb;           //номер уст-ва в сети
+    uint16_t        dev_addr;           //адрес уст-ва в сети
+    uint8_t         count_log;          //кол-во запрашиваемых записей из журнала
+    ValveCtrlMode   cold;               //команда управления электропривода холодной воды
+    ValveCtrlMode   hot;                //команда управления электропривода горячей воды
+ } PACK_PARAM;
 
-static ZB_PACK_RTC      zb_pack_rtc;
-static ZB_PACK_REQ      zb_pack_req;
-static ZB_PACK_CTRL     zb_pack_ctrl;
-static ZB_PACK_ACKDATA  zb_pack_ack;
+//Описание обработки пакета по типу пакета
+typedef struct {
+    uint8_t         size;               //размер пакета
+    uint8_t         crc_span;           //кол-во байт пакета от начала, входящих в подсчет КС
+    uint8_t         addr_send;          //смещение адреса отправителя во входящем пакете
+                                        //"0" - исходящий пакет
+    uint8_t         dev_addr;           //смещение адреса уст-ва в исходящем пакете
+                                        //"0" - пакет не адресован конкретному уст-ву
+    bool            ack;                //входящий пакет требует отправки подтверждения
+    ZBTypePack      answ;               //тип ответа уст-ва на исходящий пакет
+    ErrorStatus     (*decode)( uint8_t *data, PACK_RESULT *pack );   //разбор входящего пакета
+    void            (*encode)( uint8_t *data, PACK_PARAM *param );   //формирование исходящего пакета
+    void            (*output)( PACK_RESULT *pack );                  //вывод данных пакета
+    uint8_t         len_ofs;            //смещение размера пакета для пакетов переменного размера,
+                                        //size - максимальный размер, crc_span/addr_send - для
+                                        //пакета минимального размера; "0" - размер постоянный
+ } PACK_DESCR;
 
-static DEV_LIST         dev_list[DEV_LIST_MAX];
+//Последние принятые пакеты уст-ва (кэш), индекс уст-ва совпадает с индексом в dev_list[]
+typedef struct {
+    uint32_t        time[CACHE_TYPE_CNT];                   //время приема пакета (tick)
+    uint8_t         len[CACHE_TYPE_CNT];                    //размер пакета, "0" - пакета нет
+    uint8_t         data[CACHE_TYPE_CNT][sizeof( PACK_DATA )]; //пакет
+ } DEV_CACHE;
 
 //*************************************************************************************************
 // Прототипы локальных функций
 //*************************************************************************************************
 static uint16_t DevGetAddr( uint16_t dev_numb );
+static DEV_LIST *DevFind( uint16_t numb_dev );
+static uint16_t GetUint16( uint8_t *data );
 static ErrorStatus CheckDevList( uint16_t dev_numb, uint16_t dev_addr );
+static void DevClear( uint8_t ind );
+static const PACK_DESCR *PackDescr( ZBTypePack type );
+static int8_t CacheInd( ZBTypePack type );
+static void CacheUpd( PACK_RESULT *pack );
+static uint8_t PackShift( const PACK_DESCR *descr, uint8_t len );
+static ErrorStatus DecodeHead( uint8_t *data, PACK_RESULT *pack );
+static void EncodeRtc( uint8_t *data, PACK_PARAM *param );
+static void EncodeReq( uint8_t *data, PACK_PARAM *param );
+static void EncodeCtrl( uint8_t *data, PACK_PARAM *param );
+static void EncodeAck( uint8_t *data, PACK_PARAM *param );
+static void EncodeWin( uint8_t *data, PACK_PARAM *param );
+static void EncodeSince( uint8_t *data, PACK_PARAM *param );
+static ErrorStatus DecodeWLog( uint8_t *data, PACK_RESULT *pack );
+static ErrorStatus DecodeBatch( uint8_t *data, PACK_RESULT *pack );
+static void BatchFirst( uint8_t *data, PACK_DATA *rec );
+static ErrorStatus BatchRecord( uint8_t **ptr, uint8_t *end, PACK_DATA *rec );
+static ErrorStatus GetVarint( uint8_t **ptr, uint8_t *end, uint32_t *value );
+static void WLogWindow( PACK_RESULT *pack );
+static void OutState( PACK_RESULT *pack );
+static void OutWater( PACK_RESULT *pack );
+static void OutBatch( PACK_RESULT *pack );
+static void OutValve( PACK_RESULT *pack );
+static void OutLeaks( PACK_RESULT *pack );
 
 //*************************************************************************************************
-// Предваительная идентификация принятого пакета на соответствие: типа пакета
+// Локальные переменные
+//*************************************************************************************************
+static char str[80];
+
+//Буфер формирования исходящего пакета
+static union {
+    ZB_PACK_RTC     rtc;
+    ZB_PACK_REQ     req;
+    ZB_PACK_CTRL    ctrl;
+    ZB_PACK_ACKDATA ack;
+    ZB_PACK_WIN     win;
+    ZB_PACK_SINCE   since;
+ } zb_pack;
+
+static DEV_LIST         dev_list[DEV_LIST_MAX];
+static DEV_CACHE        dev_cache[DEV_LIST_MAX];
+
+//Типы пакетов, сохраняемых в кэше уст-ва, индекс - индекс пакета в кэше
+static const ZBTypePack cache_type[CACHE_TYPE_CNT] = { ZB_PACK_STATE, ZB_PACK_DATA, ZB_PACK_VALVE, ZB_PACK_LEAKS };
+
+//Таблица описания обработки пакетов, индекс - тип пакета ZBTypePack
+//КС входящих пакетов считается без КС и адреса отправителя, исходящих - без КС
+static const PACK_DESCR pack_descr[] = {
+    //ZB_PACK_UNDEF
+    { 0, 0, 0, 0, false, ZB_PACK_UNDEF, NULL, NULL, NULL },
+    //ZB_PACK_STATE
+    { sizeof( PACK_STATE ), offsetof( PACK_STATE, crc ), offsetof( PACK_STATE, addr_send ), 0, 
+      false, ZB_PACK_UNDEF, DecodeHead, NULL, OutState },
+    //ZB_PACK_DATA
+    { sizeof( PACK_DATA ), offsetof( PACK_DATA, crc ), offsetof( PACK_DATA, addr_send ), 0, 
+      false, ZB_PACK_UNDEF, DecodeHead, NULL, OutWater },
+    //ZB_PACK_WLOG
+    { sizeof( PACK_DATA ), offsetof( PACK_DATA, crc ), offsetof( PACK_DATA, addr_send ), 0, 
+      true, ZB_PACK_UNDEF, DecodeHead, NULL, OutWater },
+    //ZB_PACK_VALVE
+    { sizeof( PACK_VALVE ), offsetof( PACK_VALVE, crc ), offsetof( PACK_VALVE, addr_send ), 0, 
+      false, ZB_PACK_UNDEF, DecodeHead, NULL, OutValve },
+    //ZB_PACK_LEAKS
+    { sizeof( PACK_LEAKS ), offsetof( PACK_LEAKS, crc ), offsetof( PACK_LEAKS, addr_send ), 0, 
+      false, ZB_PACK_UNDEF, DecodeHead, NULL, OutLeaks },
+    //ZB_PACK_SYNC_DTIME
+    { sizeof( ZB_PACK_RTC ), offsetof( ZB_PACK_RTC, crc ), 0, 0, 
+      false, ZB_PACK_UNDEF, NULL, EncodeRtc, NULL },
+    //ZB_PACK_REQ_STATE
+    { sizeof( ZB_PACK_REQ ), offsetof( ZB_PACK_REQ, crc ), 0, offsetof( ZB_PACK_REQ, dev_addr ), 
+      false, ZB_PACK_STATE, NULL, EncodeReq, NULL },
+    //ZB_PACK_REQ_VALVE
+    { sizeof( ZB_PACK_REQ ), offsetof( ZB_PACK_REQ, crc ), 0, offsetof( ZB_PACK_REQ, dev_addr ), 
+      false, ZB_PACK_VALVE, NULL, EncodeReq, NULL },
+    //ZB_PACK_REQ_DATA
+    { sizeof( ZB_PACK_REQ ), offsetof( ZB_PACK_REQ, crc ), 0, offsetof( ZB_PACK_REQ, dev_addr ), 
+      false, ZB_PACK_DATA, NULL, EncodeReq, NULL },
+    //ZB_PACK_CTRL_VALVE
+    { sizeof( ZB_PACK_CTRL ), offsetof( ZB_PACK_CTRL, crc ), 0, offsetof( ZB_PACK_CTRL, dev_addr ), 
+      false, ZB_PACK_UNDEF, NULL, EncodeCtrl, NULL },
+    //ZB_PACK_ACK
+    { sizeof( ZB_PACK_ACKDATA ), offsetof( ZB_PACK_ACKDATA, crc ), 0, offsetof( ZB_PACK_ACKDATA, dev_addr ), 
+      false, ZB_PACK_UNDEF, NULL, EncodeAck, NULL },
+    //ZB_PACK_WLOG_SEQ
+    { sizeof( PACK_WLOG_SEQ ), offsetof( PACK_WLOG_SEQ, crc ), offsetof( PACK_WLOG_SEQ, addr_send ), 0, 
+      true, ZB_PACK_UNDEF, DecodeWLog, NULL, OutWater },
+    //ZB_PACK_REQ_WLOG
+    { sizeof( ZB_PACK_WIN ), offsetof( ZB_PACK_WIN, crc ), 0, offsetof( ZB_PACK_WIN, dev_addr ), 
+      false, ZB_PACK_WLOG_SEQ, NULL, EncodeWin, NULL },
+    //ZB_PACK_ACK_WIN
+    { sizeof( ZB_PACK_WIN ), offsetof( ZB_PACK_WIN, crc ), 0, offsetof( ZB_PACK_WIN, dev_addr ), 
+      false, ZB_PACK_UNDEF, NULL, EncodeWin, NULL },
+    //ZB_PACK_WLOG_BATCH
+    { WLOG_BATCH_MAX, offsetof( PACK_WLOG_BATCH, crc ), offsetof( PACK_WLOG_BATCH, addr_send ), 0, 
+      true, ZB_PACK_UNDEF, DecodeBatch, NULL, OutBatch, offsetof( PACK_WLOG_BATCH, size ) },
+    //ZB_PACK_REQ_BATCH
+    { sizeof( ZB_PACK_REQ ), offsetof( ZB_PACK_REQ, crc ), 0, offsetof( ZB_PACK_REQ, dev_addr ), 
+      false, ZB_PACK_WLOG_BATCH, NULL, EncodeReq, NULL },
+    //ZB_PACK_REQ_SINCE
+    { sizeof( ZB_PACK_SINCE ), offsetof( ZB_PACK_SINCE, crc ), 0, offsetof( ZB_PACK_SINCE, dev_addr ), 
+      false, ZB_PACK_WLOG_BATCH, NULL, EncodeSince, NULL }
+ };
+
+//*************************************************************************************************
+// Предваительная идентификация принятого пакета на соответствие: типа пакета. Размер пакета
+// переменного размера определяется по полю размера в пакете.
 //-------------------------------------------------------------------------------------------------
 // uint8_t *data - указатель на буфер принятого пакета
+// uint16_t len  - кол-во принятых байт, начиная с data
 // return        - размер идентифицированного пакета данных или "0" если пакет не идентифицирован
+//                 или размер пакета переменного размера не известен
 //*************************************************************************************************
-uint8_t CheckPack1( uint8_t *data ) {
+uint8_t CheckPack1( uint8_t *data, uint16_t len ) {
 
-    ZBTypePack type;
+    uint8_t size;
+    const PACK_DESCR *descr;
     
-    type = (ZBTypePack)*data;
-    if ( type == ZB_PACK_STATE )
-        return sizeof( PACK_STATE );
-    if ( ( type == ZB_PACK_DATA || type == ZB_PACK_WLOG ) )
-        return sizeof( PACK_DATA );
-    if ( type == ZB_PACK_VALVE )
-        return sizeof( PACK_VALVE );
-    if ( type == ZB_PACK_LEAKS )
-        return sizeof( PACK_LEAKS );
-    return 0;
+    descr = PackDescr( (ZBTypePack)*data );
+    if ( descr == NULL || !descr->addr_send )
+        return 0;
+    if ( !descr->len_ofs )
+        return descr->size;
+    if ( len <= descr->len_ofs )
+        return 0;
+    size = *( data + descr->len_ofs );
+    if ( size < descr->addr_send + sizeof( uint16_t ) || size > descr->size )
+        return 0;
+    return size;
+ }
+
+//*************************************************************************************************
+// Проверка контрольной суммы пакета без разбора данных пакета, используется для поиска
+// начала пакета в блоке принятых данных. Пакет завершается КС и адресом отправителя,
+// адрес отправителя в подсчет КС не входит. Вызывается также из прерывания приема для
+// проверки пакета известного размера (см. RecvCheck()).
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data    - указатель на буфер принятого пакета
+// uint8_t len      - размер пакета
+// return = SUCCESS - КС пакета совпадает
+//        = ERROR   - ошибка КС
+//*************************************************************************************************
+ErrorStatus CheckPackCRC( uint8_t *data, uint8_t len ) {
+
+    const PACK_DESCR *descr;
+
+    descr = PackDescr( (ZBTypePack)*data );
+    if ( descr == NULL || !descr->addr_send || CheckPack1( data, len ) != len )
+        return ERROR;
+    len = descr->crc_span + PackShift( descr, len );
+    if ( GetUint16( data + len ) != CalcCRC16( data, len ) )
+        return ERROR;
+    return SUCCESS;
  }
 
 //*************************************************************************************************
-// Проверка принятого пакета на соответствие: типа пакета/размера/контрольная сумма
+// Разбор принятого пакета и проверка на соответствие: типа пакета/размера/адреса отправителя.
+// Контрольная сумма пакета здесь не проверяется: пакет передается для разбора только после
+// проверки КС при поиске начала пакета в блоке (CheckPackCRC()) или при приеме.
+// Пакет проверяется в буфере приема без копирования, поля пакета читаются побайтно 
+// (пакет в буфере приема может быть не выровнен).
 //-------------------------------------------------------------------------------------------------
 // uint8_t *data      - указатель на буфер принятого пакета
 // uint8_t len        - размер принятого пакета
-// DATA_ACK *ptr_data - указатель на структуру в которой размещаются номер и адрес отправителя
-//                      для последующего использования при отправки подтверждения
+// PACK_RESULT *pack  - указатель на структуру для размещения результата разбора пакета
 // return             - тип идентифицированного пакета данных или ZB_PACK_UNDEF
 //*************************************************************************************************
-ZBTypePack CheckPack2( uint8_t *data, uint8_t len, DATA_ACK *ptr_data ) {
+ZBTypePack CheckPack2( uint8_t *data, uint8_t len, PACK_RESULT *pack ) {
 
-    uint16_t crc, addr_send;
     ZBTypePack type;
+    const PACK_DESCR *descr;
     
-    ptr_data->dev_numb = 0;
-    ptr_data->net_addr = 0;
+    memset( (uint8_t *)pack, 0x00, sizeof( PACK_RESULT ) );
     type = (ZBTypePack)*data;
-    if ( type == ZB_PACK_STATE && len == sizeof( pack_state ) ) {
-        //текущее состояние контроллера
-        memcpy( (uint8_t *)&pack_state, data, sizeof( pack_state ) );
-        //КС считаем без полученной КС и net_addr (gate_addr не входит в подсчет КС)
-        crc = CalcCRC16( (uint8_t *)&pack_state, sizeof( pack_state ) - ( sizeof( uint16_t ) * 2 ) );
-        if ( pack_state.crc != crc ) {
-            ZBIncError( ZB_ERROR_CRC );
-            return ZB_PACK_UNDEF;
-           }
-        //проверка адреса отправителя
-        addr_send = __REVSH( *( (uint16_t *)&pack_state.addr_send ) );
-        if ( pack_state.dev_addr != addr_send ) {
-            ZBIncError( ZB_ERROR_ADDR );
-            return ZB_PACK_UNDEF;
-           }
-        //добавим адрес уст-ва в список доступных уст-в
-        CheckDevList( pack_state.dev_numb, pack_state.dev_addr );
-        return type;
+    //проверка типа/размера пакета
+    descr = PackDescr( type );
+    if ( descr == NULL || descr->decode == NULL || CheckPack1( data, len ) != len )
+        return ZB_PACK_UNDEF;
+    if ( descr->decode( data, pack ) == ERROR ) {
+        ZBIncError( ZB_ERROR_DATA );
+        return ZB_PACK_UNDEF;
        }
-    if ( ( type == ZB_PACK_DATA || type == ZB_PACK_WLOG ) && len == sizeof( pack_data ) ) {
-        //текущие данные расхода/давления/утечки воды
-        //журнальных данных расхода/давления/утечки воды
-        memcpy( (uint8_t *)&pack_data, data, sizeof( pack_data ) );
-        //КС считаем без полученной КС и net_addr (gate_addr не входит в подсчет КС)
-        crc = CalcCRC16( (uint8_t *)&pack_data, sizeof( pack_data ) - ( sizeof( uint16_t ) * 2 ) );
-        if ( pack_data.crc != crc ) {
-            ZBIncError( ZB_ERROR_CRC );
-            return ZB_PACK_UNDEF;
-           }
-        //проверка адреса отправителя
-        addr_send = __REVSH( *( (uint16_t *)&pack_data.addr_send ) );
-        if ( pack_data.dev_addr != addr_send ) {
-            ZBIncError( ZB_ERROR_ADDR );
-            return ZB_PACK_UNDEF;
-           }
-        //добавим адрес уст-ва в список доступных уст-в
-        CheckDevList( pack_data.dev_numb, pack_data.dev_addr );
-        if ( type == ZB_PACK_WLOG && ptr_data != NULL ) {
-            //данные для формирования пакета подтверждения ZB_PACK_ACK
-            ptr_data->dev_numb = pack_data.dev_numb;
-            ptr_data->net_addr = pack_data.dev_addr;
-           }
-        return type;
+    //проверка адреса отправителя, адрес передается в формате big endian
+    if ( pack->dev_addr != (uint16_t)__REVSH( GetUint16( data + descr->addr_send + PackShift( descr, len ) ) ) ) {
+        ZBIncError( ZB_ERROR_ADDR );
+        return ZB_PACK_UNDEF;
        }
-    if ( type == ZB_PACK_VALVE && len == sizeof( pack_valve ) ) {
-        //текущее состояние уст-ва
-        memcpy( (uint8_t *)&pack_valve, data, sizeof( pack_valve ) );
-        //КС считаем без полученной КС и net_addr (gate_addr не входит в подсчет КС)
-        crc = CalcCRC16( (uint8_t *)&pack_valve, sizeof( pack_valve ) - ( sizeof( uint16_t ) * 2 ) );
-        if ( pack_valve.crc != crc ) {
-            ZBIncError( ZB_ERROR_CRC );
-            return ZB_PACK_UNDEF;
-           }
-        //проверка адреса отправителя
-        addr_send = __REVSH( *( (uint16_t *)&pack_valve.addr_send ) );
-        if ( pack_valve.dev_addr != addr_send ) {
-            ZBIncError( ZB_ERROR_ADDR );
-            return ZB_PACK_UNDEF;
-           }
-        //добавим адрес уст-ва в список доступных уст-в
-        CheckDevList( pack_valve.dev_numb, pack_valve.dev_addr );
-        return type;
-       }
-    if ( type == ZB_PACK_LEAKS && len == sizeof( pack_leaks ) ) {
-        //текущее состояние электроприводов
-        memcpy( (uint8_t *)&pack_leaks, data, sizeof( pack_leaks ) );
-        //КС считаем без полученной КС и net_addr (gate_addr не входит в подсчет КС)
-        crc = CalcCRC16( (uint8_t *)&pack_leaks, sizeof( pack_leaks ) - ( sizeof( uint16_t ) * 2 ) );
-        if ( pack_leaks.crc != crc ) {
-            ZBIncError( ZB_ERROR_CRC );
-            return ZB_PACK_UNDEF;
-           }
-        //проверка адреса отправителя
-        addr_send = __REVSH( *( (uint16_t *)&pack_leaks.addr_send ) );
-        if ( pack_leaks.dev_addr != addr_send ) {
-            ZBIncError( ZB_ERROR_ADDR );
-            return ZB_PACK_UNDEF;
-           }
-        //добавим адрес уст-ва в список доступных уст-в
-        CheckDevList( pack_leaks.dev_numb, pack_leaks.dev_addr );
-        return type;
-       }
-    return ZB_PACK_UNDEF;
+    //добавим адрес уст-ва в список доступных уст-в
+    CheckDevList( pack->dev_numb, pack->dev_addr );
+    pack->type_pack = type;
+    pack->len = len;
+    pack->data = data;
+    pack->ack = descr->ack;
+    //сохранение текущих данных уст-ва в кэше
+    CacheUpd( pack );
+    //журнальные данные с передачей окном: проверка порядка записей
+    if ( type == ZB_PACK_WLOG_SEQ )
+        WLogWindow( pack );
+    return type;
+ }
+
+//*************************************************************************************************
+// Возвращает ожидаемый тип ответа уст-ва на исходящий пакет и номер уст-ва, которому 
+// адресован пакет. По номеру уст-ва и типу ответа выполняется сопоставление ответа с запросом.
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data      - указатель на исходящий пакет
+// uint8_t len        - размер пакета
+// uint16_t *dev_numb - указатель для размещения номера уст-ва
+// return             - тип ответа или ZB_PACK_UNDEF, если ответ на пакет не предусмотрен
+//*************************************************************************************************
+ZBTypePack CheckPackAnsw( uint8_t *data, uint8_t len, uint16_t *dev_numb ) {
+
+    const PACK_DESCR *descr;
+
+    *dev_numb = 0;
+    descr = PackDescr( (ZBTypePack)*data );
+    if ( descr == NULL || descr->encode == NULL || descr->size != len )
+        return ZB_PACK_UNDEF;
+    if ( descr->dev_addr )
+        *dev_numb = GetUint16( data + offsetof( ZB_PACK_REQ, dev_numb ) );
+    //запрос журнальных данных: ответ - журнальные данные, без указания кол-ва записей - текущие
+    if ( *data == ZB_PACK_REQ_DATA && *( data + offsetof( ZB_PACK_REQ, count_log ) ) )
+        return ZB_PACK_WLOG;
+    return descr->answ;
  }
 
 //*************************************************************************************************
@@ -199,122 +331,597 @@ ZBTypePack CheckPack2( uint8_t *data, uint8_t len, DATA_ACK *ptr_data ) {
 //*************************************************************************************************
 uint8_t *CreatePack( ZBTypePack type, uint16_t dev_numb, uint16_t *net_addr, uint8_t count_log, ValveCtrlMode cold, ValveCtrlMode hot, uint8_t *len ) {
 
-    *len = 0;
-    if ( type == ZB_PACK_SYNC_DTIME ) {
-        //синхронизация дата/время
-        zb_pack_rtc.type_pack = ZB_PACK_SYNC_DTIME;     //тип пакета
-        GetTimeDate( &zb_pack_rtc.date_time );          //текущие дата/время
-        *net_addr = 0;
-        //контрольная сумма
-        zb_pack_rtc.crc = CalcCRC16( (uint8_t *)&zb_pack_rtc, sizeof( zb_pack_rtc ) - sizeof( zb_pack_rtc.crc ) );
-        *len = sizeof( zb_pack_rtc );
-        return (uint8_t *)&zb_pack_rtc;
+    *len = EncodePack( (uint8_t *)&zb_pack, sizeof( zb_pack ), type, dev_numb, net_addr, count_log, cold, hot );
+    if ( !*len )
+        return NULL;
+    return (uint8_t *)&zb_pack;
+ }
+
+//*************************************************************************************************
+// Функция формирует пакет данных для отправки по ZigBee в буфере вызывающей функции, 
+// используется для формирования пакета непосредственно в буфере передачи (без копирования). 
+// Все поля пакета заполняются функцией формирования пакета, обнуление буфера не требуется.
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data      - указатель на буфер для размещения пакета
+// uint8_t size       - размер буфера
+// ZBTypePack type    - тип формируемого пакета
+// uint16_t dev_numb  - номер уст-ва
+// uint16_t *net_addr - адрес уст-ва
+// uint8_t count_log  - кол-во запрашиваемых записей (только для ZB_PACK_REQ_DATA)
+// ValveCtrlMode cold - команда управления электроприводом крана холодной воды
+// ValveCtrlMode hot  - команды управления электроприводом крана горячей воды
+// return = 0         - тип пакета не указан, уст-ва нет в списке или нет места в буфере
+//        > 0         - размер сформированного пакета
+//*************************************************************************************************
+uint8_t EncodePack( uint8_t *data, uint8_t size, ZBTypePack type, uint16_t dev_numb, uint16_t *net_addr, uint8_t count_log, ValveCtrlMode cold, ValveCtrlMode hot ) {
+
+    uint16_t crc;
+    PACK_PARAM param;
+    const PACK_DESCR *descr;
+
+    descr = PackDescr( type );
+    if ( descr == NULL || descr->encode == NULL || descr->size > size )
+        return 0;
+    param.dev_numb = 0;
+    param.dev_addr = 0;
+    param.count_log = count_log;
+    param.cold = cold;
+    param.hot = hot;
+    if ( descr->dev_addr ) {
+        //пакет адресован уст-ву: адрес уст-ва в сети по номеру
+        param.dev_numb = dev_numb;
+        param.dev_addr = DevGetAddr( dev_numb );
        }
-    if ( type == ZB_PACK_REQ_STATE ) {
-        //запрос текущего состояния контроллера
-        zb_pack_req.type_pack = ZB_PACK_REQ_STATE;      //тип пакета
-        zb_pack_req.dev_numb = dev_numb;                //номер уст-ва
-        zb_pack_req.dev_addr = DevGetAddr( dev_numb );  //адрес уст-ва в сети
-        *net_addr = zb_pack_req.dev_addr;
-        zb_pack_req.count_log = 0;                      //кол-во запрашиваемых записей из журнала
-        if ( !zb_pack_req.dev_addr || !dev_numb )
-            return NULL; //номер и адрес уст-ва не могут быть равны "0"
-        zb_pack_req.crc = CalcCRC16( (uint8_t *)&zb_pack_req, sizeof( zb_pack_req ) - sizeof( zb_pack_req.crc ) );
-        *len = sizeof( zb_pack_req );
-        return (uint8_t *)&zb_pack_req;
+    *net_addr = param.dev_addr;
+    if ( descr->dev_addr && ( !param.dev_addr || !dev_numb ) )
+        return 0; //номер и адрес уст-ва не могут быть равны "0"
+    *data = type;                                       //тип пакета
+    descr->encode( data, &param );
+    //контрольная сумма
+    crc = CalcCRC16( data, descr->crc_span );
+    memcpy( data + descr->crc_span, (uint8_t *)&crc, sizeof( crc ) );
+    return descr->size;
+ }
+
+//*************************************************************************************************
+// Вывод данных принятых в пакете
+//-------------------------------------------------------------------------------------------------
+// PACK_RESULT *pack - результат разбора пакета
+//*************************************************************************************************
+void OutData( PACK_RESULT *pack ) {
+
+    const PACK_DESCR *descr;
+
+    if ( pack == NULL || pack->data == NULL || pack->dup == true )
+        return;
+    descr = PackDescr( pack->type_pack );
+    if ( descr != NULL && descr->output != NULL )
+        descr->output( pack );
+ }
+
+//*************************************************************************************************
+// Возвращает описание обработки пакета по типу пакета
+//-------------------------------------------------------------------------------------------------
+// ZBTypePack type - тип пакета
+// return = NULL   - тип пакета не определен
+//*************************************************************************************************
+static const PACK_DESCR *PackDescr( ZBTypePack type ) {
+
+    if ( type == ZB_PACK_UNDEF || type >= SIZE_ARRAY( pack_descr ) )
+        return NULL;
+    return &pack_descr[type];
+ }
+
+//*************************************************************************************************
+// Возвращает индекс типа пакета в кэше уст-ва
+//-------------------------------------------------------------------------------------------------
+// ZBTypePack type - тип пакета
+// return = -1     - пакет не сохраняется в кэше
+//*************************************************************************************************
+static int8_t CacheInd( ZBTypePack type ) {
+
+    uint8_t ind;
+
+    for ( ind = 0; ind < CACHE_TYPE_CNT; ind++ ) {
+        if ( cache_type[ind] == type )
+            return ind;
        }
-    if ( type == ZB_PACK_REQ_DATA ) {
-        //запрос журнальных/текущих данных расхода/давления/утечки воды
-        zb_pack_req.type_pack = ZB_PACK_REQ_DATA;       //тип пакета
-        zb_pack_req.dev_numb = dev_numb;                //номер уст-ва
-        zb_pack_req.dev_addr = DevGetAddr( dev_numb );  //адрес уст-ва в сети
-        *net_addr = zb_pack_req.dev_addr;
-        zb_pack_req.count_log = count_log;              //кол-во запрашиваемых записей из журнала
-        if ( !zb_pack_req.dev_addr || !dev_numb )
-            return NULL; //номер и адрес уст-ва не могут быть равны "0"
-        zb_pack_req.crc = CalcCRC16( (uint8_t *)&zb_pack_req, sizeof( zb_pack_req ) - sizeof( zb_pack_req.crc ) );
-        *len = sizeof( zb_pack_req );
-        return (uint8_t *)&zb_pack_req;
+    return -1;
+ }
+
+//*************************************************************************************************
+// Сохранение принятого пакета текущих данных в кэше уст-ва, вызывается из CheckPack2()
+// после добавления уст-ва в список доступных уст-в
+//-------------------------------------------------------------------------------------------------
+// PACK_RESULT *pack - результат разбора пакета
+//*************************************************************************************************
+static void CacheUpd( PACK_RESULT *pack ) {
+
+    int8_t ind;
+    DEV_LIST *dev;
+    DEV_CACHE *cache;
+
+    ind = CacheInd( pack->type_pack );
+    dev = DevFind( pack->dev_numb );
+    if ( ind < 0 || dev == NULL || pack->len > sizeof( dev_cache[0].data[0] ) )
+        return;
+    cache = &dev_cache[dev - dev_list];
+    osKernelLock();
+    memcpy( cache->data[ind], pack->data, pack->len );
+    cache->len[ind] = pack->len;
+    cache->time[ind] = osKernelGetTickCount();
+    osKernelUnlock();
+ }
+
+//*************************************************************************************************
+// Вывод текущих данных уст-ва из кэша без запроса к уст-ву. Данные выводятся, если 
+// возраст данных не превышает config.cache_age.
+//-------------------------------------------------------------------------------------------------
+// uint16_t numb_dev - логический номер уст-ва
+// ZBTypePack type   - тип пакета данных
+// return = true     - данные выведены из кэша
+//        = false    - данных нет или данные устарели, требуется запрос к уст-ву
+//*************************************************************************************************
+bool DevCacheOut( uint16_t numb_dev, ZBTypePack type ) {
+
+    int8_t ind;
+    uint32_t age;
+    DEV_LIST *dev;
+    DEV_CACHE *cache;
+    PACK_RESULT pack;
+    uint8_t data[sizeof( dev_cache[0].data[0] )];
+
+    ind = CacheInd( type );
+    dev = DevFind( numb_dev );
+    if ( ind < 0 || dev == NULL || !config.cache_age || config.cache_age > CACHE_AGE_MAX )
+        return false;
+    cache = &dev_cache[dev - dev_list];
+    //копия пакета в стеке вызывающей задачи: кэш обновляется и очищается в TaskZBCtrl()
+    osKernelLock();
+    age = osKernelGetTickCount() - cache->time[ind];
+    memset( (uint8_t *)&pack, 0x00, sizeof( pack ) );
+    pack.len = cache->len[ind];
+    memcpy( data, cache->data[ind], pack.len );
+    pack.dev_numb = dev->numb_dev;
+    pack.dev_addr = dev->addr_dev;
+    osKernelUnlock();
+    if ( !pack.len || age > config.cache_age * 1000 )
+        return false;
+    pack.type_pack = type;
+    pack.data = data;
+    OutData( &pack );
+    sprintf( str, "Cached data, age: %u.%u sec\r\n", age / 1000, ( age % 1000 ) / 100 );
+    UartSendStr( str );
+    return true;
+ }
+
+//*************************************************************************************************
+// Возвращает смещение КС и адреса отправителя пакета переменного размера относительно 
+// пакета минимального размера
+//-------------------------------------------------------------------------------------------------
+// const PACK_DESCR *descr - описание обработки пакета
+// uint8_t len             - размер пакета
+// return                  - смещение, для пакетов постоянного размера "0"
+//*************************************************************************************************
+static uint8_t PackShift( const PACK_DESCR *descr, uint8_t len ) {
+
+    if ( !descr->len_ofs )
+        return 0;
+    return len - ( descr->addr_send + sizeof( uint16_t ) );
+ }
+
+//*************************************************************************************************
+// Разбор заголовка входящего пакета, заголовок всех входящих пакетов одинаковый: 
+// тип пакета, номер уст-ва, адрес уст-ва
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data     - указатель на пакет в буфере приема
+// PACK_RESULT *pack - указатель на результат разбора
+//*************************************************************************************************
+static ErrorStatus DecodeHead( uint8_t *data, PACK_RESULT *pack ) {
+
+    pack->dev_numb = GetUint16( data + offsetof( PACK_STATE, dev_numb ) );
+    pack->dev_addr = GetUint16( data + offsetof( PACK_STATE, dev_addr ) );
+    return SUCCESS;
+ }
+
+//*************************************************************************************************
+// Разбор пакета журнальных данных с порядковым номером записи
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data     - указатель на пакет в буфере приема
+// PACK_RESULT *pack - указатель на результат разбора
+//*************************************************************************************************
+static ErrorStatus DecodeWLog( uint8_t *data, PACK_RESULT *pack ) {
+
+    DecodeHead( data, pack );
+    pack->seq = *( data + offsetof( PACK_WLOG_SEQ, seq ) );
+    return SUCCESS;
+ }
+
+//*************************************************************************************************
+// Разбор пакета с несколькими журнальными записями: проверка кол-ва записей и разностных
+// записей до КС пакета, записи восстанавливаются при выводе данных
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data     - указатель на пакет в буфере приема
+// PACK_RESULT *pack - указатель на результат разбора
+// return = ERROR    - кол-во/размер записей не соответствует размеру пакета
+//*************************************************************************************************
+static ErrorStatus DecodeBatch( uint8_t *data, PACK_RESULT *pack ) {
+
+    uint8_t cnt, *ptr, *end;
+    PACK_DATA rec;
+
+    DecodeHead( data, pack );
+    cnt = *( data + offsetof( PACK_WLOG_BATCH, count ) );
+    if ( !cnt )
+        return ERROR;
+    ptr = data + offsetof( PACK_WLOG_BATCH, crc );
+    end = data + *( data + offsetof( PACK_WLOG_BATCH, size ) ) - sizeof( uint16_t ) * 2;
+    BatchFirst( data, &rec );
+    while ( --cnt ) {
+        if ( BatchRecord( &ptr, end, &rec ) == ERROR )
+            return ERROR;
        }
-    if ( type == ZB_PACK_REQ_VALVE ) {
-        //запрос текущего состояния электроприводов подачи воды
-        zb_pack_req.type_pack = ZB_PACK_REQ_VALVE;      //тип пакета
-        zb_pack_req.dev_numb = dev_numb;                //номер уст-ва
-        zb_pack_req.dev_addr = DevGetAddr( dev_numb );  //адрес уст-ва в сети
-        *net_addr = zb_pack_req.dev_addr;
-        zb_pack_req.count_log = 0;                      //кол-во запрашиваемых записей из журнала
-        if ( !zb_pack_req.dev_addr || !dev_numb )
-            return NULL; //номер и адрес уст-ва не могут быть равны "0"
-        zb_pack_req.crc = CalcCRC16( (uint8_t *)&zb_pack_req, sizeof( zb_pack_req ) - sizeof( zb_pack_req.crc ) );
-        *len = sizeof( zb_pack_req );
-        return (uint8_t *)&zb_pack_req;
+    return ptr == end ? SUCCESS : ERROR;
+ }
+
+//*************************************************************************************************
+// Первая журнальная запись пакета ZB_PACK_WLOG_BATCH, запись передается полностью
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data   - указатель на пакет в буфере приема
+// PACK_DATA *rec  - указатель для размещения записи
+//*************************************************************************************************
+static void BatchFirst( uint8_t *data, PACK_DATA *rec ) {
+
+    rec->type_pack = ZB_PACK_WLOG;
+    rec->dev_numb = GetUint16( data + offsetof( PACK_WLOG_BATCH, dev_numb ) );
+    rec->dev_addr = GetUint16( data + offsetof( PACK_WLOG_BATCH, dev_addr ) );
+    memcpy( (uint8_t *)rec + offsetof( PACK_DATA, date_time ), data + offsetof( PACK_WLOG_BATCH, date_time ), 
+            offsetof( PACK_DATA, crc ) - offsetof( PACK_DATA, date_time ) );
+ }
+
+//*************************************************************************************************
+// Восстановление журнальной записи по разностной записи пакета ZB_PACK_WLOG_BATCH
+//-------------------------------------------------------------------------------------------------
+// uint8_t **ptr   - указатель на текущую позицию в пакете, смещается на следующую запись
+// uint8_t *end    - окончание записей в пакете
+// PACK_DATA *rec  - предыдущая запись, заменяется на восстановленную
+// return = ERROR  - запись выходит за пределы пакета
+//*************************************************************************************************
+static ErrorStatus BatchRecord( uint8_t **ptr, uint8_t *end, PACK_DATA *rec ) {
+
+    uint32_t delta;
+
+    //дата/время события
+    if ( GetVarint( ptr, end, &delta ) == ERROR )
+        return ERROR;
+    if ( delta )
+        SecToDtime( DtimeToSec( &rec->date_time ) + delta, &rec->date_time );
+    //значения счетчиков
+    if ( GetVarint( ptr, end, &delta ) == ERROR )
+        return ERROR;
+    rec->count_cold += delta;
+    if ( GetVarint( ptr, end, &delta ) == ERROR )
+        return ERROR;
+    rec->count_hot += delta;
+    if ( GetVarint( ptr, end, &delta ) == ERROR )
+        return ERROR;
+    rec->count_filter += delta;
+    //давление, состояния датчиков и электроприводов
+    if ( end - *ptr < WLOG_REC_TAIL )
+        return ERROR;
+    memcpy( (uint8_t *)rec + offsetof( PACK_DATA, pressr_cold ), *ptr, WLOG_REC_TAIL );
+    *ptr += WLOG_REC_TAIL;
+    return SUCCESS;
+ }
+
+//*************************************************************************************************
+// Чтение значения в формате varint: по 7 бит в байте, младшие биты первыми, 
+// бит 7 - признак продолжения
+//-------------------------------------------------------------------------------------------------
+// uint8_t **ptr   - указатель на текущую позицию в пакете, смещается за значение
+// uint8_t *end    - окончание данных
+// uint32_t *value - указатель для размещения значения
+// return = ERROR  - значение выходит за пределы данных или превышает 32 бита
+//*************************************************************************************************
+static ErrorStatus GetVarint( uint8_t **ptr, uint8_t *end, uint32_t *value ) {
+
+    uint8_t shift;
+
+    *value = 0;
+    for ( shift = 0; shift < 32; shift += 7 ) {
+        if ( *ptr >= end )
+            return ERROR;
+        *value |= (uint32_t)( **ptr & 0x7F ) << shift;
+        if ( !( *(*ptr)++ & 0x80 ) )
+            return SUCCESS;
        }
-    if ( type == ZB_PACK_CTRL_VALVE ) {
-        //управление электроприводами подачи воды
-        zb_pack_ctrl.type_pack = ZB_PACK_CTRL_VALVE;    //тип пакета
-        zb_pack_ctrl.dev_numb = dev_numb;               //номер уст-ва
-        zb_pack_ctrl.dev_addr = DevGetAddr( dev_numb ); //адрес уст-ва в сети
-        *net_addr = zb_pack_ctrl.dev_addr;
-        if ( !zb_pack_ctrl.dev_addr || !dev_numb )
-            return NULL; //номер и адрес уст-ва не могут быть равны "0"
-        zb_pack_ctrl.cold = cold;                       //команда управления электропривода горячей воды
-        zb_pack_ctrl.hot = hot;                         //команды управления электропривода холодной воды
-        zb_pack_ctrl.crc = CalcCRC16( (uint8_t *)&zb_pack_ctrl, sizeof( zb_pack_ctrl ) - sizeof( zb_pack_ctrl.crc ) );
-        *len = sizeof( zb_pack_ctrl );
-        return (uint8_t *)&zb_pack_ctrl;
+    return ERROR;
+ }
+
+//*************************************************************************************************
+// Контроль окна передачи журнальных данных. Записи, принятые по порядку, подтверждаются
+// одним пакетом ZB_PACK_ACK_WIN на половину окна (или последнюю запись журнала), уст-во
+// продолжает передачу не дожидаясь подтверждения, пока кол-во неподтвержденных записей 
+// не превышает окно. Повтор или запись не по порядку не выводится и сразу подтверждается 
+// номером последней записи, принятой по порядку, уст-во повторяет передачу со следующей.
+//-------------------------------------------------------------------------------------------------
+// PACK_RESULT *pack - результат разбора пакета, 
+//                     pack->seq - номер записи в пакете, заменяется на номер подтверждения
+//*************************************************************************************************
+static void WLogWindow( PACK_RESULT *pack ) {
+
+    DEV_LIST *dev;
+
+    dev = DevFind( pack->dev_numb );
+    if ( dev == NULL ) {
+        pack->ack = false;
+        return;
        }
-    if ( type == ZB_PACK_ACK ) {
-        //управление электроприводами подачи воды
-        zb_pack_ack.type_pack = ZB_PACK_ACK;            //тип пакета
-        zb_pack_ack.dev_numb = dev_numb;                //номер уст-ва
-        zb_pack_ack.dev_addr = DevGetAddr( dev_numb );  //адрес уст-ва в сети
-        *net_addr = zb_pack_ack.dev_addr;
-        if ( !zb_pack_ack.dev_addr || !dev_numb )
-            return NULL; //номер и адрес уст-ва не могут быть равны "0"
-        zb_pack_ack.crc = CalcCRC16( (uint8_t *)&zb_pack_ack, sizeof( zb_pack_ack ) - sizeof( zb_pack_ack.crc ) );
-        *len = sizeof( zb_pack_ack );
-        return (uint8_t *)&zb_pack_ack;
+    dev->wlog_tick = osKernelGetTickCount();
+    if ( pack->seq != dev->wlog_seq ) {
+        //повтор или потеря записи: подтверждаем последнюю запись, принятую по порядку,
+        //до получения первой записи номер подтверждения равен 0xFF
+        pack->dup = true;
+        pack->seq = dev->wlog_seq - 1;
+        dev->wlog_cnt = 0;
+        return;
        }
-    return NULL;
+    dev->wlog_seq++;
+    if ( dev->wlog_left )
+        dev->wlog_left--;
+    if ( ++dev->wlog_cnt < WLOG_WINDOW / 2 && dev->wlog_left ) {
+        //подтверждение откладывается до приема половины окна
+        pack->ack = false;
+        return;
+       }
+    dev->wlog_cnt = 0;
  }
 
 //*************************************************************************************************
-// Вывод данных принятых в пакете
+// Формирование пакета синхронизации даты/времени
 //-------------------------------------------------------------------------------------------------
-// ZBTypePack id_pack - тип пакета
+// uint8_t *data      - указатель на буфер пакета
+// PACK_PARAM *param  - параметры пакета
 //*************************************************************************************************
-void OutData( ZBTypePack id_pack ) {
+static void EncodeRtc( uint8_t *data, PACK_PARAM *param ) {
 
-    if ( id_pack == ZB_PACK_STATE ) {
-        //вывод текущих значений уст-ва
-        sprintf( str, "\r\nDevice number: ............ %05u (0x%04X)\r\n", pack_state.dev_numb, pack_state.dev_numb );
-        UartSendStr( str );
-        sprintf( str, "Net Address: .............. 0x%04X\r\n", pack_state.dev_addr );
-        UartSendStr( str );
-        //источник сброса контроллера
-        sprintf( str, "Source reset: ............. %s\r\n", ResetSrcDesc( pack_state.res_src ) );
-        UartSendStr( str );
-        //дата/время включения контроллера
-        sprintf( str, "Date/time of activation: .. %02u.%02u.%04u  %02u:%02u:%02u\r\n", 
-                 pack_state.start.day, pack_state.start.month, pack_state.start.year, pack_state.start.hour, pack_state.start.min, pack_state.start.sec );
-        UartSendStr( str );
-        //дата/время часов удаленного контроллера
-        sprintf( str, "Date/time of RTC: ......... %02u.%02u.%04u  %02u:%02u:%02u\r\n", 
-                 pack_state.rtc.day, pack_state.rtc.month, pack_state.rtc.year, pack_state.rtc.hour, pack_state.rtc.min, pack_state.rtc.sec );
-        UartSendStr( str );
+    GetTimeDate( &( (ZB_PACK_RTC *)data )->date_time );  //текущие дата/время
+ }
+
+//*************************************************************************************************
+// Формирование пакета запроса данных ZB_PACK_REQ_STATE, ZB_PACK_REQ_VALVE, ZB_PACK_REQ_DATA,
+// ZB_PACK_REQ_BATCH
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data      - указатель на буфер пакета
+// PACK_PARAM *param  - параметры пакета
+//*************************************************************************************************
+static void EncodeReq( uint8_t *data, PACK_PARAM *param ) {
+
+    ZB_PACK_REQ *req = (ZB_PACK_REQ *)data;
+
+    req->dev_numb = param->dev_numb;                    //номер уст-ва
+    req->dev_addr = param->dev_addr;                    //адрес уст-ва в сети
+    //кол-во запрашиваемых записей из журнала (только для ZB_PACK_REQ_DATA, ZB_PACK_REQ_BATCH)
+    req->count_log = req->type_pack == ZB_PACK_REQ_DATA || req->type_pack == ZB_PACK_REQ_BATCH ? param->count_log : 0;
+ }
+
+//*************************************************************************************************
+// Формирование пакета управления электроприводами подачи воды
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data      - указатель на буфер пакета
+// PACK_PARAM *param  - параметры пакета
+//*************************************************************************************************
+static void EncodeCtrl( uint8_t *data, PACK_PARAM *param ) {
+
+    ZB_PACK_CTRL *ctrl = (ZB_PACK_CTRL *)data;
+
+    ctrl->dev_numb = param->dev_numb;                   //номер уст-ва
+    ctrl->dev_addr = param->dev_addr;                   //адрес уст-ва в сети
+    ctrl->cold = param->cold;                           //команда управления электропривода холодной воды
+    ctrl->hot = param->hot;                             //команды управления электропривода горячей воды
+ }
+
+//*************************************************************************************************
+// Формирование пакета подтверждения получения журнальных данных
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data      - указатель на буфер пакета
+// PACK_PARAM *param  - параметры пакета
+//*************************************************************************************************
+static void EncodeAck( uint8_t *data, PACK_PARAM *param ) {
+
+    ZB_PACK_ACKDATA *ack = (ZB_PACK_ACKDATA *)data;
+
+    ack->dev_numb = param->dev_numb;                    //номер уст-ва
+    ack->dev_addr = param->dev_addr;                    //адрес уст-ва в сети
+ }
+
+//*************************************************************************************************
+// Формирование пакета запроса журнальных данных с передачей окном ZB_PACK_REQ_WLOG и
+// подтверждения записей окна ZB_PACK_ACK_WIN. Контроль окна передачи уст-ва сбрасывается 
+// не при формировании, а при передаче запроса (см. WLogStart()).
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data      - указатель на буфер пакета
+// PACK_PARAM *param  - параметры пакета, count_log - кол-во записей из журнала или 
+//                      номер подтверждаемой записи
+//*************************************************************************************************
+static void EncodeWin( uint8_t *data, PACK_PARAM *param ) {
+
+    ZB_PACK_WIN *win = (ZB_PACK_WIN *)data;
+
+    win->dev_numb = param->dev_numb;                    //номер уст-ва
+    win->dev_addr = param->dev_addr;                    //адрес уст-ва в сети
+    win->value = param->count_log;                      //кол-во записей/номер подтверждения
+    win->window = WLOG_WINDOW;                          //размер окна передачи
+ }
+
+//*************************************************************************************************
+// Начало передачи журнальных данных окном: сброс контроля окна передачи уст-ва. 
+// Вызывается из TaskZBCtrl() после передачи запроса ZB_PACK_REQ_WLOG.
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data - указатель на переданный пакет ZB_PACK_REQ_WLOG
+//*************************************************************************************************
+void WLogStart( uint8_t *data ) {
+
+    DEV_LIST *dev;
+
+    dev = DevFind( GetUint16( data + offsetof( ZB_PACK_WIN, dev_numb ) ) );
+    if ( dev == NULL )
+        return;
+    dev->wlog_seq = 0;
+    dev->wlog_cnt = 0;
+    dev->wlog_left = *( data + offsetof( ZB_PACK_WIN, value ) );
+    dev->wlog_tick = osKernelGetTickCount();
+ }
+
+//*************************************************************************************************
+// Проверка выполнения передачи журнальных данных окном: передача выполняется, если не все
+// записи получены и записи поступают с интервалом не более WLOG_IDLE_TIME
+//-------------------------------------------------------------------------------------------------
+// uint16_t numb_dev - логический номер уст-ва
+// return = true     - выполняется передача журнальных данных окном
+//*************************************************************************************************
+bool WLogBusy( uint16_t numb_dev ) {
+
+    DEV_LIST *dev;
+
+    dev = DevFind( numb_dev );
+    if ( dev == NULL || !dev->wlog_left )
+        return false;
+    return osKernelGetTickCount() - dev->wlog_tick < WLOG_IDLE_TIME;
+ }
+
+//*************************************************************************************************
+// Завершение передачи журнальных данных окном, записи которой не поступают WLOG_IDLE_TIME 
+// (в журнале уст-ва меньше записей, чем запрошено, или передача прервана). Вызывается из 
+// TaskZBCtrl() раз в секунду, неподтвержденные записи окна подтверждаются финальным 
+// подтверждением ZB_PACK_ACK_WIN.
+//-------------------------------------------------------------------------------------------------
+// uint16_t *numb_dev - номер уст-ва для финального подтверждения
+// uint8_t *seq       - номер подтверждаемой записи
+// return = true      - требуется финальное подтверждение, false - больше нет
+//*************************************************************************************************
+bool WLogEnd( uint16_t *numb_dev, uint8_t *seq ) {
+
+    uint8_t i;
+    bool ack;
+    DEV_LIST *dev;
+
+    for ( i = 0; i < DEV_LIST_MAX; i++ ) {
+        dev = &dev_list[i];
+        if ( !dev->numb_dev || ( !dev->wlog_left && !dev->wlog_cnt ) )
+            continue;
+        if ( osKernelGetTickCount() - dev->wlog_tick < WLOG_IDLE_TIME )
+            continue;
+        ack = dev->wlog_cnt ? true : false;
+        dev->wlog_cnt = 0;
+        dev->wlog_left = 0;
+        if ( ack == true ) {
+            *numb_dev = dev->numb_dev;
+            *seq = dev->wlog_seq - 1;
+            return true;
+           }
+       }
+    return false;
+ }
+
+//*************************************************************************************************
+// Формирование пакета запроса журнальных данных, записанных после даты/времени последней
+// полученной от уст-ва записи (позиция сбора журнальных данных уст-ва)
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data      - указатель на буфер пакета
+// PACK_PARAM *param  - параметры пакета
+//*************************************************************************************************
+static void EncodeSince( uint8_t *data, PACK_PARAM *param ) {
+
+    ZB_PACK_SINCE *since = (ZB_PACK_SINCE *)data;
+
+    since->dev_numb = param->dev_numb;                  //номер уст-ва
+    since->dev_addr = param->dev_addr;                  //адрес уст-ва в сети
+    since->count_log = param->count_log;                //кол-во запрашиваемых записей
+    JournalCursor( param->dev_numb, &since->date_time );
+ }
+
+//*************************************************************************************************
+// Вывод текущих значений уст-ва: источник сброса, дата/время включения, часы контроллера
+//-------------------------------------------------------------------------------------------------
+// PACK_RESULT *pack - результат разбора пакета
+//*************************************************************************************************
+static void OutState( PACK_RESULT *pack ) {
+
+    PACK_STATE *pack_state = (PACK_STATE *)pack->data;
+
+    sprintf( str, "\r\nDevice number: ............ %05u (0x%04X)\r\n", pack->dev_numb, pack->dev_numb );
+    UartSendStr( str );
+    sprintf( str, "Net Address: .............. 0x%04X\r\n", pack->dev_addr );
+    UartSendStr( str );
+    //источник сброса контроллера
+    sprintf( str, "Source reset: ............. %s\r\n", ResetSrcDesc( pack_state->res_src ) );
+    UartSendStr( str );
+    //дата/время включения контроллера
+    sprintf( str, "Date/time of activation: .. %02u.%02u.%04u  %02u:%02u:%02u\r\n", 
+             pack_state->start.day, pack_state->start.month, pack_state->start.year, pack_state->start.hour, pack_state->start.min, pack_state->start.sec );
+    UartSendStr( str );
+    //дата/время часов удаленного контроллера
+    sprintf( str, "Date/time of RTC: ......... %02u.%02u.%04u  %02u:%02u:%02u\r\n", 
+             pack_state->rtc.day, pack_state->rtc.month, pack_state->rtc.year, pack_state->rtc.hour, pack_state->rtc.min, pack_state->rtc.sec );
+    UartSendStr( str );
+ }
+
+//*************************************************************************************************
+// Вывод текущих/журнальных данных расхода/давления/утечки воды
+//-------------------------------------------------------------------------------------------------
+// PACK_RESULT *pack - результат разбора пакета
+//*************************************************************************************************
+static void OutWater( PACK_RESULT *pack ) {
+
+    WaterData( (void *)pack->data, pack->type_pack == ZB_PACK_DATA ? OUT_DATA : OUT_LOG );
+    if ( pack->type_pack != ZB_PACK_DATA )
+        JournalRecv( pack->dev_numb, (DATE_TIME *)( pack->data + offsetof( PACK_DATA, date_time ) ) );
+ }
+
+//*************************************************************************************************
+// Вывод журнальных данных пакета с несколькими записями, записи восстанавливаются 
+// последовательно, пакет проверен при разборе в DecodeBatch()
+//-------------------------------------------------------------------------------------------------
+// PACK_RESULT *pack - результат разбора пакета
+//*************************************************************************************************
+static void OutBatch( PACK_RESULT *pack ) {
+
+    uint8_t cnt, *ptr, *end;
+    PACK_DATA rec;
+
+    //первая запись передается полностью
+    BatchFirst( pack->data, &rec );
+    WaterData( (void *)&rec, OUT_LOG );
+    JournalRecv( pack->dev_numb, &rec.date_time );
+    //последующие записи - разностью от предыдущей
+    cnt = *( pack->data + offsetof( PACK_WLOG_BATCH, count ) );
+    ptr = pack->data + offsetof( PACK_WLOG_BATCH, crc );
+    end = pack->data + pack->len - sizeof( uint16_t ) * 2;
+    while ( --cnt && BatchRecord( &ptr, end, &rec ) == SUCCESS ) {
+        WaterData( (void *)&rec, OUT_LOG );
+        JournalRecv( pack->dev_numb, &rec.date_time );
        }
-    //вывод текущих данных
-    if ( id_pack == ZB_PACK_DATA )
-        WaterData( (void *)&pack_data, OUT_DATA );
-    //вывод журнальных данных
-    if ( id_pack == ZB_PACK_WLOG )
-        WaterData( (void *)&pack_data, OUT_LOG );
-    //вывод текущих состояний электроприводов
-    if ( id_pack == ZB_PACK_VALVE )
-        ValveStatus( (VALVE_STAT_ERR *)&pack_valve.valve_stat );
-    //вывод состояния датчиков утечки
-    if ( id_pack == ZB_PACK_LEAKS )
-        LeakData( (VALVE_STAT_ERR *)&pack_leaks );
+ }
+
+//*************************************************************************************************
+// Вывод текущих состояний электроприводов
+//-------------------------------------------------------------------------------------------------
+// PACK_RESULT *pack - результат разбора пакета
+//*************************************************************************************************
+static void OutValve( PACK_RESULT *pack ) {
+
+    ValveStatus( (VALVE_STAT_ERR *)( pack->data + offsetof( PACK_VALVE, valve_stat ) ) );
+ }
+
+//*************************************************************************************************
+// Вывод состояния датчиков утечки
+//-------------------------------------------------------------------------------------------------
+// PACK_RESULT *pack - результат разбора пакета
+//*************************************************************************************************
+static void OutLeaks( PACK_RESULT *pack ) {
+
+    LeakData( (void *)pack->data );
  }
 
 //*************************************************************************************************
@@ -333,7 +940,7 @@ static ErrorStatus CheckDevList( uint16_t numb_dev, uint16_t addr_dev ) {
     
     for ( i = 0; i < DEV_LIST_MAX; i++ ) {
         if ( dev_list[i].numb_dev == numb_dev ) {
-            //уст-во найдено, обновим сетевой адрес
+            //уст-во найдено, обновим сетевой адрес, оценка времени ответа сохраняется
             dev_list[i].addr_dev = addr_dev;
             dev_list[i].last_upd = 0;
             return SUCCESS;
@@ -344,14 +951,26 @@ static ErrorStatus CheckDevList( uint16_t numb_dev, uint16_t addr_dev ) {
         if ( dev_list[i].numb_dev )
             continue;
         //добавляем уст-во в список
+        DevClear( i );
         dev_list[i].numb_dev = numb_dev;
         dev_list[i].addr_dev = addr_dev;
-        dev_list[i].last_upd = 0;
+        dev_list[i].retry = RETRY_BUDGET;
         return SUCCESS;
        }
     return ERROR;
  }
 
+//*************************************************************************************************
+// Удаление уст-ва из списка: обнуление записи списка уст-в и кэша данных уст-ва
+//-------------------------------------------------------------------------------------------------
+// uint8_t ind - индекс записи в списке уст-в
+//*************************************************************************************************
+static void DevClear( uint8_t ind ) {
+
+    memset( (uint8_t *)&dev_list[ind], 0x00, sizeof( DEV_LIST ) );
+    memset( (uint8_t *)&dev_cache[ind], 0x00, sizeof( DEV_CACHE ) );
+ }
+
 //*************************************************************************************************
 // Функция возращает сетевой адрес по логическому номеру уст-ва 
 //-------------------------------------------------------------------------------------------------
@@ -361,21 +980,146 @@ static ErrorStatus CheckDevList( uint16_t numb_dev, uint16_t addr_dev ) {
 //*************************************************************************************************
 static uint16_t DevGetAddr( uint16_t numb_dev ) {
 
+    DEV_LIST *dev;
+    
+    dev = DevFind( numb_dev );
+    if ( dev == NULL )
+        return 0;
+    return dev->addr_dev;
+ }
+
+//*************************************************************************************************
+// Поиск уст-ва в списке по логическому номеру
+//-------------------------------------------------------------------------------------------------
+// uint16_t numb_dev - логический номер уст-ва
+// return = NULL     - уст-ва нет в списке
+//        != NULL    - указатель на запись уст-ва в списке
+//*************************************************************************************************
+static DEV_LIST *DevFind( uint16_t numb_dev ) {
+
     uint8_t i;
     
     if ( !numb_dev )
-        return 0;
+        return NULL;
     for ( i = 0; i < DEV_LIST_MAX; i++ ) {
         //поиск уст-ва по номеру в списке
         if ( dev_list[i].numb_dev == numb_dev ) 
-            return dev_list[i].addr_dev;
+            return &dev_list[i];
        }
-    return 0;
+    return NULL;
+ }
+
+//*************************************************************************************************
+// Обновление оценки времени ответа уст-ва по измеренному времени ответа на запрос.
+// Расчет аналогичен расчету RTO в TCP: SRTT = 7/8 * SRTT + 1/8 * RTT, 
+// RTTVAR = 3/4 * RTTVAR + 1/4 * |SRTT - RTT|, RTO = SRTT + 4 * RTTVAR.
+// Значения SRTT и RTTVAR хранятся в масштабе 8 и 4 для расчета в целых числах.
+//-------------------------------------------------------------------------------------------------
+// uint16_t numb_dev - логический номер уст-ва
+// uint32_t rtt      - время от окончания передачи запроса до получения ответа (ms)
+//*************************************************************************************************
+void DevRttUpd( uint16_t numb_dev, uint32_t rtt ) {
+
+    int32_t delta;
+    uint32_t rto;
+    DEV_LIST *dev;
+    
+    dev = DevFind( numb_dev );
+    if ( dev == NULL )
+        return;
+    //"0" - признак отсутствия измерений, минимальное значение 1 ms
+    if ( !rtt )
+        rtt = 1;
+    if ( rtt > RTO_MAX )
+        rtt = RTO_MAX;
+    if ( !dev->srtt ) {
+        //первое измерение: SRTT = RTT, RTTVAR = RTT/2
+        dev->srtt = rtt << 3;
+        dev->rttvar = rtt << 1;
+       }
+    else {
+        delta = (int32_t)rtt - (int32_t)( dev->srtt >> 3 );
+        dev->srtt += delta;
+        if ( delta < 0 )
+            delta = -delta;
+        dev->rttvar += delta - (int32_t)( dev->rttvar >> 2 );
+       }
+    rto = ( dev->srtt >> 3 ) + ( dev->rttvar ? dev->rttvar : 1 );
+    if ( rto < RTO_MIN )
+        rto = RTO_MIN;
+    if ( rto > RTO_MAX )
+        rto = RTO_MAX;
+    dev->rto = rto;
+ }
+
+//*************************************************************************************************
+// Увеличение времени ожидания ответа уст-ва в 2 раза при отсутствии ответа на запрос,
+// до получения следующего измерения времени ответа
+//-------------------------------------------------------------------------------------------------
+// uint16_t numb_dev - логический номер уст-ва
+//*************************************************************************************************
+void DevRtoBackoff( uint16_t numb_dev ) {
+
+    DEV_LIST *dev;
+    
+    dev = DevFind( numb_dev );
+    if ( dev == NULL || !dev->rto )
+        return;
+    dev->rto = ( dev->rto << 1 ) > RTO_MAX ? RTO_MAX : ( dev->rto << 1 );
+ }
+
+//*************************************************************************************************
+// Проверка и уменьшение лимита повторных передач уст-ву
+//-------------------------------------------------------------------------------------------------
+// uint16_t numb_dev - логический номер уст-ва
+// return = true     - повторная передача разрешена
+//        = false    - лимит повторов исчерпан или уст-ва нет в списке
+//*************************************************************************************************
+bool DevRetryTake( uint16_t numb_dev ) {
+
+    DEV_LIST *dev;
+    
+    dev = DevFind( numb_dev );
+    if ( dev == NULL || !dev->retry )
+        return false;
+    dev->retry--;
+    return true;
+ }
+
+//*************************************************************************************************
+// Восстановление лимита повторных передач уст-ву при получении ответа
+//-------------------------------------------------------------------------------------------------
+// uint16_t numb_dev - логический номер уст-ва
+//*************************************************************************************************
+void DevRetryGive( uint16_t numb_dev ) {
+
+    DEV_LIST *dev;
+    
+    dev = DevFind( numb_dev );
+    if ( dev != NULL && dev->retry < RETRY_BUDGET )
+        dev->retry++;
+ }
+
+//*************************************************************************************************
+// Функция возвращает время ожидания ответа уст-ва по оценке времени ответа
+//-------------------------------------------------------------------------------------------------
+// uint16_t numb_dev - логический номер уст-ва
+// return            - время ожидания ответа (ms), TIME_WAIT_ANSWER - нет измерений
+//*************************************************************************************************
+uint16_t DevRto( uint16_t numb_dev ) {
+
+    DEV_LIST *dev;
+    
+    dev = DevFind( numb_dev );
+    if ( dev == NULL || !dev->rto )
+        return TIME_WAIT_ANSWER;
+    return dev->rto;
  }
 
 //*************************************************************************************************
 // Обновление времени последнего ответа модуля
-// Вызов выполняется из HAL_RTCEx_RTCEventCallback()
+// Вызов выполняется из TaskZBCtrl() по секундному событию RTC (см. ZBTimeTick()), запись 
+// списка и кэш уст-ва очищаются с блокировкой, т.к. кэш читается в задаче консоли
 //*************************************************************************************************
 void DevListUpd( void ) {
 
@@ -385,9 +1129,9 @@ void DevListUpd( void ) {
         dev_list[i].last_upd++;
         if ( dev_list[i].last_upd > MAX_TIME_UPDATE ) {
             //при превышении времени последнего обновления - удалим уст-во
-            dev_list[i].numb_dev = 0;
-            dev_list[i].addr_dev = 0;
-            dev_list[i].last_upd = 0;
+            osKernelLock();
+            DevClear( i );
+            osKernelUnlock();
            }
        }
  }
@@ -399,11 +1143,35 @@ void DevListClr( void ) {
 
     uint8_t i;
     
+    for ( i = 0; i < DEV_LIST_MAX; i++ )
+        DevClear( i );
+ }
+
+//*************************************************************************************************
+// Функция возвращает номер следующего уст-ва в списке доступных уст-в, используется для
+// опроса уст-в по очереди
+//-------------------------------------------------------------------------------------------------
+// uint16_t numb_dev - номер текущего уст-ва, "0" - поиск с начала списка
+// return = 0        - список уст-в пустой
+//        > 0        - номер следующего уст-ва (после последнего - первое)
+//*************************************************************************************************
+uint16_t DevListNext( uint16_t numb_dev ) {
+
+    uint8_t i, cnt;
+    
+    //позиция текущего уст-ва в списке
     for ( i = 0; i < DEV_LIST_MAX; i++ ) {
-        dev_list[i].numb_dev = 0;
-        dev_list[i].addr_dev = 0;
-        dev_list[i].last_upd = 0;
+        if ( numb_dev && dev_list[i].numb_dev == numb_dev )
+            break;
        }
+    if ( i == DEV_LIST_MAX )
+        i = DEV_LIST_MAX - 1; //уст-во не найдено: поиск с начала списка
+    for ( cnt = 0; cnt < DEV_LIST_MAX; cnt++ ) {
+        i = ( i + 1 ) % DEV_LIST_MAX;
+        if ( dev_list[i].numb_dev )
+            return dev_list[i].numb_dev;
+       }
+    return 0;
  }
 
 //*************************************************************************************************
@@ -424,6 +1192,29 @@ void DeviceList( void ) {
         ptr += sprintf( ptr, "NetAddrss: 0x%04X  ", dev_list[i].addr_dev );
         ptr += sprintf( ptr, "Last update: %u (sec)\r\n", dev_list[i].last_upd );
         UartSendStr( str );
+        //оценка времени ответа уст-ва
+        if ( !dev_list[i].srtt ) {
+            UartSendStr( "        RTT: no data  RTO: " );
+            sprintf( str, "%u (ms)\r\n", TIME_WAIT_ANSWER );
+           }
+        else sprintf( str, "        SRTT: %u  RTTVAR: %u  RTO: %u (ms)\r\n", dev_list[i].srtt >> 3, dev_list[i].rttvar >> 2, dev_list[i].rto );
+        UartSendStr( str );
+        sprintf( str, "        Retry budget: %u\r\n", dev_list[i].retry );
+        UartSendStr( str );
        }
     UartSendStr( (char *)msg_str_delim );
  }
+
+//*************************************************************************************************
+// Чтение 16-битного значения из буфера без требования к выравниванию
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data - указатель на значение в буфере
+// return        - значение
+//*************************************************************************************************
+static uint16_t GetUint16( uint8_t *data ) {
+
+    uint16_t value;
+
+    memcpy( (uint8_t *)&value, data, sizeof( value ) );
+    return value;
+ }
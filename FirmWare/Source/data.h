@@ -25,9 +25,38 @@ typedef enum {
     ZB_PACK_REQ_VALVE,                  //состояние электроприводов подачи воды
     ZB_PACK_REQ_DATA,                   //запрос журнальных/текущих данных расхода/давления/утечки воды
     ZB_PACK_CTRL_VALVE,                 //управление электроприводами подачи воды
-    ZB_PACK_ACK                         //подтверждение получение пакета с журнальными данными
+    ZB_PACK_ACK,                        //подтверждение получение пакета с журнальными данными
+    //передача журнальных данных окном
+    ZB_PACK_WLOG_SEQ,                   //входящий: журнальные данные с порядковым номером записи
+    ZB_PACK_REQ_WLOG,                   //исходящий: запрос журнальных данных с передачей окном
+    ZB_PACK_ACK_WIN,                    //исходящий: подтверждение записей окна по номер включительно
+    //передача журнальных данных пакетом из нескольких записей
+    ZB_PACK_WLOG_BATCH,                 //входящий: несколько журнальных записей в одном пакете
+    ZB_PACK_REQ_BATCH,                  //исходящий: запрос журнальных данных пакетами из нескольких записей
+    ZB_PACK_REQ_SINCE                   //исходящий: запрос журнальных данных, записанных после
+                                        //указанной даты/времени (ответ - ZB_PACK_WLOG_BATCH)
  } ZBTypePack;
 
+#define DEV_LIST_MAX            10      //максимальное кол-во устройств в списке доступных уст-в
+#define WLOG_WINDOW             8       //кол-во журнальных записей, передаваемых уст-вом 
+                                        //без подтверждения (окно передачи)
+#define WLOG_BATCH_MAX          96      //максимальный размер пакета ZB_PACK_WLOG_BATCH
+#define WLOG_IDLE_TIME          2000    //время без журнальных записей, после которого передача 
+                                        //окном считается завершенной (msec)
+
+//Результат разбора принятого пакета, данные пакета не копируются: поле data указывает 
+//на пакет в буфере приема и действительно до возврата ячейки приема в пул
+typedef struct {
+    ZBTypePack      type_pack;          //тип пакета или ZB_PACK_UNDEF
+    uint16_t        dev_numb;           //номер уст-ва в сети
+    uint16_t        dev_addr;           //адрес уст-ва в сети
+    uint8_t         len;                //размер пакета
+    uint8_t         *data;              //указатель на пакет в буфере приема
+    bool            ack;                //требуется отправка подтверждения
+    bool            dup;                //повтор или запись не по порядку, данные не выводятся
+    uint8_t         seq;                //номер подтверждаемой записи (ZB_PACK_WLOG_SEQ)
+ } PACK_RESULT;
+
 #pragma pack( push, 1 )
 
 //Структура данных для хранения списка уст-в и их адресов
@@ -35,15 +64,16 @@ typedef struct {
     uint16_t        numb_dev;           //номер уст-ва в сети
     uint16_t        addr_dev;           //адрес уст-ва в сети
     uint32_t        last_upd;           //время прошедшее с последнего обновления данных от уст-ва (сек)
+    uint32_t        srtt;               //сглаженное время ответа уст-ва (ms * 8), "0" - нет измерений
+    uint32_t        rttvar;             //сглаженное отклонение времени ответа (ms * 4)
+    uint16_t        rto;                //расчетное время ожидания ответа уст-ва (ms)
+    uint8_t         retry;              //остаток лимита повторных передач уст-ву
+    uint8_t         wlog_seq;           //номер следующей ожидаемой журнальной записи
+    uint8_t         wlog_cnt;           //кол-во записей, принятых после последнего подтверждения
+    uint8_t         wlog_left;          //кол-во записей до окончания передачи журнала
+    uint32_t        wlog_tick;          //время передачи запроса/приема последней записи (tick)
 } DEV_LIST;
 
-//Структура для хранения параметров уст-ва для формирования 
-//подтверждений при запросе журнальных данных по команде ZB_PACK_REQ_DATA 
-typedef struct {
-    uint16_t dev_numb;
-    uint16_t net_addr;
- } DATA_ACK;
-
 //*************************************************************************************************
 // Входящие пакеты от уст-ва
 // для получения корректного значения адреса отправителя необходимо 
@@ -83,6 +113,63 @@ typedef struct {
     uint16_t        addr_send;          //адрес отправителя (в подсчет контрольной суммы не входит)
  } PACK_DATA;
 
+//Журнальные данные с порядковым номером записи, начало пакета совпадает с PACK_DATA
+typedef struct {
+    ZBTypePack      type_pack;          //тип пакета
+    uint16_t        dev_numb;           //номер уст-ва в сети
+    uint16_t        dev_addr;           //адрес уст-ва в сети
+    //значения учета
+    DATE_TIME       date_time;          //дата/время события
+    uint32_t        count_cold;         //значения счетчика холодной воды
+    uint32_t        count_hot;          //значения счетчика горячей воды
+    uint32_t        count_filter;       //значения счетчика питьевой воды
+    uint16_t        pressr_cold;        //давление холодной воды
+    uint16_t        pressr_hot;         //давление горячей воды
+    LeakStat        leak1 : 1;          //состояние датчика утечки #1
+    LeakStat        leak2 : 1;          //состояние датчика утечки #2
+    unsigned        reserv : 4;         //выравнивание до 1 байта
+    EventType       type_event : 1;     //признак данных: данные/событие
+    DC12VStat       dc12_chk : 1;       //контроль напряжения 12VDc для питания датчиков утечки
+    VALVE_STAT_ERR  valve_stat;         //состояния электроприводов
+    uint8_t         seq;                //порядковый номер записи в передаче, начиная с "0"
+    uint16_t        crc;                //контрольная сумма
+    uint16_t        addr_send;          //адрес отправителя (в подсчет контрольной суммы не входит)
+ } PACK_WLOG_SEQ;
+
+//Журнальные данные, несколько записей в одном пакете. Пакет переменного размера, структура 
+//описывает пакет с одной записью. Первая запись передается полностью, каждая следующая - 
+//разностью относительно предыдущей записи, значения разности в формате varint (по 7 бит 
+//в байте, младшие биты первыми, бит 7 - признак продолжения):
+//  varint   - секунды от даты/времени предыдущей записи
+//  varint   - прирост count_cold
+//  varint   - прирост count_hot
+//  varint   - прирост count_filter
+//  pressr_cold, pressr_hot, байт состояний, valve_stat - без изменений (как в PACK_DATA)
+//КС и адрес отправителя следуют за последней записью
+typedef struct {
+    ZBTypePack      type_pack;          //тип пакета
+    uint16_t        dev_numb;           //номер уст-ва в сети
+    uint16_t        dev_addr;           //адрес уст-ва в сети
+    uint8_t         size;               //размер пакета с КС и адресом отправителя
+    uint8_t         count;              //кол-во записей в пакете
+    //значения учета первой записи
+    DATE_TIME       date_time;          //дата/время события
+    uint32_t        count_cold;         //значения счетчика холодной воды
+    uint32_t        count_hot;          //значения счетчика горячей воды
+    uint32_t        count_filter;       //значения счетчика питьевой воды
+    uint16_t        pressr_cold;        //давление холодной воды
+    uint16_t        pressr_hot;         //давление горячей воды
+    LeakStat        leak1 : 1;          //состояние датчика утечки #1
+    LeakStat        leak2 : 1;          //состояние датчика утечки #2
+    unsigned        reserv : 4;         //выравнивание до 1 байта
+    EventType       type_event : 1;     //признак данных: данные/событие
+    DC12VStat       dc12_chk : 1;       //контроль напряжения 12VDc для питания датчиков утечки
+    VALVE_STAT_ERR  valve_stat;         //состояния электроприводов
+    //разностные записи
+    uint16_t        crc;                //контрольная сумма
+    uint16_t        addr_send;          //адрес отправителя (в подсчет контрольной суммы не входит)
+ } PACK_WLOG_BATCH;
+
 //Состояния электроприводов
 typedef struct {
     ZBTypePack      type_pack;          //тип пакета
@@ -128,6 +215,29 @@ typedef struct {
     uint16_t        crc;                //контрольная сумма
  } ZB_PACK_REQ;
 
+//Запрос журнальных данных с передачей окном ZB_PACK_REQ_WLOG,
+//подтверждение записей окна ZB_PACK_ACK_WIN
+typedef struct {
+    ZBTypePack      type_pack;          //тип пакета
+    uint16_t        dev_numb;           //номер уст-ва в сети
+    uint16_t        dev_addr;           //адрес уст-ва в сети
+    uint8_t         value;              //кол-во записей из журнала (ZB_PACK_REQ_WLOG)
+                                        //номер последней записи, принятой по порядку (ZB_PACK_ACK_WIN)
+    uint8_t         window;             //размер окна передачи (кол-во записей)
+    uint16_t        crc;                //контрольная сумма
+ } ZB_PACK_WIN;
+
+//Запрос журнальных данных, записанных после указанной даты/времени ZB_PACK_REQ_SINCE
+typedef struct {
+    ZBTypePack      type_pack;          //тип пакета
+    uint16_t        dev_numb;           //номер уст-ва в сети
+    uint16_t        dev_addr;           //адрес уст-ва в сети
+    uint8_t         count_log;          //кол-во записей из журнала
+    DATE_TIME       date_time;          //дата/время последней полученной записи,
+                                        //нулевое значение - с начала журнала
+    uint16_t        crc;                //контрольная сумма
+ } ZB_PACK_SINCE;
+
 //Команды управления электроприводами
 typedef struct {
     ZBTypePack      type_pack;          //тип пакета
@@ -154,10 +264,23 @@ typedef struct {
 void DevListUpd( void );
 void DevListClr( void );
 void DeviceList( void );
-void OutData( ZBTypePack id_pack );
+uint16_t DevListNext( uint16_t numb_dev );
+bool DevCacheOut( uint16_t numb_dev, ZBTypePack type );
+void WLogStart( uint8_t *data );
+bool WLogBusy( uint16_t numb_dev );
+bool WLogEnd( uint16_t *numb_dev, uint8_t *seq );
+void DevRttUpd( uint16_t numb_dev, uint32_t rtt );
+void DevRtoBackoff( uint16_t numb_dev );
+uint16_t DevRto( uint16_t numb_dev );
+bool DevRetryTake( uint16_t numb_dev );
+void DevRetryGive( uint16_t numb_dev );
+void OutData( PACK_RESULT *pack );
 uint8_t *CreatePack( ZBTypePack type, uint16_t dev_numb, uint16_t *net_addr, uint8_t count_log, ValveCtrlMode cold, ValveCtrlMode hot, uint8_t *len );
-uint8_t CheckPack1( uint8_t *data );
-ZBTypePack CheckPack2( uint8_t *data, uint8_t len, DATA_ACK *ptr_data );
+uint8_t EncodePack( uint8_t *data, uint8_t size, ZBTypePack type, uint16_t dev_numb, uint16_t *net_addr, uint8_t count_log, ValveCtrlMode cold, ValveCtrlMode hot );
+uint8_t CheckPack1( uint8_t *data, uint16_t len );
+ErrorStatus CheckPackCRC( uint8_t *data, uint8_t len );
+ZBTypePack CheckPack2( uint8_t *data, uint8_t len, PACK_RESULT *pack );
+ZBTypePack CheckPackAnsw( uint8_t *data, uint8_t len, uint16_t *dev_numb );
 
 
 #endif 
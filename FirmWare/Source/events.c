@@ -33,6 +33,27 @@ void HAL_UART_RxCpltCallback( UART_HandleTypeDef *huart ) {
         ZBRecvComplt();
 }
 
+//*************************************************************************************************
+// CallBack функция, вызывается при приеме данных по DMA в режиме "до паузы в приеме" (IDLE), 
+// а также при заполнении половины/всего циклического буфера приема
+//-------------------------------------------------------------------------------------------------
+// uint16_t size - текущая позиция записи данных в приемном буфере
+//*************************************************************************************************
+void HAL_UARTEx_RxEventCallback( UART_HandleTypeDef *huart, uint16_t size ) {
+
+    if ( huart == &huart3 )
+        ZBRecvEvent( size );
+ }
+
+//*************************************************************************************************
+// CallBack функция, вызывается при ошибке приема (переполнение, шум, ошибка кадра)
+//*************************************************************************************************
+void HAL_UART_ErrorCallback( UART_HandleTypeDef *huart ) {
+
+    if ( huart == &huart3 )
+        ZBRecvError();
+ }
+
 //*************************************************************************************************
 // CallBack функция, вызывается при завершении передачи из UART
 //*************************************************************************************************
@@ -52,7 +73,7 @@ void HAL_RTCEx_RTCEventCallback( RTC_HandleTypeDef *hrtc ) {
     DATE_TIME date_time;
     
     GetTimeDate( &date_time );
-    DevListUpd();
+    ZBTimeTick();
  }
 
 //*************************************************************************************************
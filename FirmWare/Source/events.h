@@ -41,9 +41,11 @@ extern osEventFlagsId_t uart_event, chk_event, cmnd_event;
 #define EVN_ZB_CONFIG               0x00000001  //проверка настроек модуля ZigBee
 
 #define EVN_ZC_RECV_CHECK           0x00000010  //прием пакета завершен
-#define EVN_ZC_SEND_WLOG            0x00000020  //вывод журнальных данных
+#define EVN_ZC_DEV_UPD              0x00000020  //секундное событие RTC: обновление списка уст-в
+#define EVN_ZC_SEND_REQ             0x00000040  //в очередь добавлен запрос на передачу пакета
+#define EVN_ZC_SEND_ANSW            0x00000080  //получен ответ на переданный пакет
 
-#define EVN_ZC_MASK                 ( EVN_ZC_RECV_CHECK | EVN_ZC_SEND_WLOG )
+#define EVN_ZC_MASK                 ( EVN_ZC_RECV_CHECK | EVN_ZC_DEV_UPD | EVN_ZC_SEND_REQ | EVN_ZC_SEND_ANSW )
 
 
 #define EVN_ZB_RECV_CHECK           0x00000100  //прием пакета завершен
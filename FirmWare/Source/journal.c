@@ -0,0 +1,465 @@
+
+//*************************************************************************************************
+//
+// Фоновый сбор журнальных данных терминалов
+// Уст-ва из списка доступных уст-в опрашиваются по очереди, запросы разным уст-вам
+// выполняются одновременно (не более JRN_REQ_MAX), время ответа одного уст-ва перекрывается
+// передачей данных другого. Сбор выполняется только при отсутствии в очереди передачи
+// команд управления и интерактивных запросов.
+// Для каждого уст-ва хранится позиция сбора (дата/время последней полученной записи), 
+// запрашиваются только записи после этой позиции. Позиции сохраняются в отдельной 
+// странице FLASH памяти с задержкой JRN_SAVE_DELAY: измененные позиции дописываются
+// последовательно в стертую область страницы, страница стирается только при заполнении,
+// после стирания записываются все позиции. При сбое питания теряются изменения позиций
+// за время не более JRN_SAVE_DELAY, записи журнала после сохраненной позиции будут
+// запрошены повторно.
+//
+//*************************************************************************************************
+
+#include <string.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "cmsis_os2.h"
+
+#include "journal.h"
+#include "config.h"
+#include "data.h"
+#include "zigbee.h"
+#include "uart.h"
+#include "crc16.h"
+#include "message.h"
+
+//*************************************************************************************************
+// Внешние переменные
+//*************************************************************************************************
+extern CONFIG config;
+
+//*************************************************************************************************
+// Локальные константы
+//*************************************************************************************************
+#define JRN_TIME_STEP           100         //интервал проверки очереди передачи и опроса (msec)
+#define JRN_REQ_MAX             2           //кол-во одновременно выполняемых запросов разным уст-вам
+#define JRN_RECORDS             16          //кол-во записей журнала в одном запросе
+#define JRN_XFER_GAP            5000        //максимальная пауза между записями, учитываемая
+                                            //во времени передачи (msec)
+#define JRN_CURSOR_MAX          16          //кол-во хранимых позиций сбора журнальных данных
+#define JRN_SAVE_DELAY          1800000     //задержка сохранения позиций после изменения (msec)
+#define JRN_REC_MAX             ( FLASH_PAGE_BYTES / sizeof( JRN_REC ) ) //кол-во записей в странице
+
+//*************************************************************************************************
+// Локальные типы данных
+//*************************************************************************************************
+//Состояние сбора журнальных данных уст-ва
+typedef struct {
+    uint16_t        dev_numb;           //номер уст-ва в сети, "0" - запись не используется
+    volatile bool   busy;               //выполняется запрос журнальных данных
+    uint32_t        time_next;          //время следующего запроса (tick)
+    uint32_t        time_mark;          //время запроса/последней принятой записи (tick)
+    uint32_t        time_xfer;          //время передачи записей (msec)
+    uint32_t        req;                //кол-во запросов
+    uint32_t        err;                //кол-во запросов, завершенных с ошибкой
+    uint32_t        recs;               //кол-во принятых записей
+ } JRN_DEV;
+
+#pragma pack( push, 1 )
+
+//Позиция сбора журнальных данных уст-ва
+typedef struct {
+    uint16_t        dev_numb;           //номер уст-ва в сети, "0" - позиция не используется
+    DATE_TIME       date_time;          //дата/время последней полученной записи
+ } JRN_CURSOR;
+
+//Запись позиции в FLASH памяти, размер кратный 4 байтам
+typedef struct {
+    uint8_t         slot;               //индекс позиции, 0xFF - стертая область страницы
+    JRN_CURSOR      cursor;             //позиция сбора журнальных данных
+    uint16_t        crc;                //КС записи
+ } JRN_REC;
+
+#pragma pack( pop )
+
+//*************************************************************************************************
+// Локальные переменные
+//*************************************************************************************************
+static char str[100];
+static uint32_t jrn_yield;              //кол-во пропусков опроса из-за приоритетных запросов
+static JRN_DEV jrn_dev[DEV_LIST_MAX];
+static JRN_CURSOR jrn_cursor[JRN_CURSOR_MAX]; //позиции сбора журнальных данных
+static bool cursor_dirty[JRN_CURSOR_MAX]; //позиция изменена после сохранения
+static bool jrn_dirty;                  //позиции изменены, требуется сохранение
+static uint16_t jrn_rec_pos;            //индекс первой свободной записи в странице FLASH
+static uint32_t jrn_erase;              //кол-во стираний страницы FLASH после запуска
+static uint32_t jrn_dirty_time;         //время изменения позиций (tick)
+static uint8_t jrn_save_err;            //код ошибки последнего сохранения позиций
+
+//*************************************************************************************************
+// Прототипы локальных функций
+//*************************************************************************************************
+static void TaskJournal( void *pvParameters );
+static void JournalDone( ZBErrorState state, void *arg );
+static JRN_DEV *JrnFind( uint16_t dev_numb, bool add );
+static JRN_CURSOR *CursorFind( uint16_t dev_numb, bool add );
+static void CursorLoad( void );
+static void CursorSave( void );
+
+//*************************************************************************************************
+// Атрибуты объектов RTOS
+//*************************************************************************************************
+//наибольшая глубина стека по графу вызовов: TaskJournal -> ZBSendCreate -> EncodePack ->
+//EncodeSince -> JournalCursor -> CursorFind ~460 байт + 64 байта контекста, сохранение позиций
+//(CursorSave -> FlashWrite -> HAL) ~260 байт, запас ~20%, проверяется командой "task"
+static const osThreadAttr_t task_attr = {
+    .name = "Journal",
+    .stack_size = 640,
+    .priority = osPriorityBelowNormal
+ };
+
+//*************************************************************************************************
+// Инициализация задачи сбора журнальных данных
+//*************************************************************************************************
+void JournalInit( void ) {
+
+    memset( (uint8_t *)jrn_dev, 0x00, sizeof( jrn_dev ) );
+    CursorLoad();
+    //создаем задачу
+    osThreadNew( TaskJournal, NULL, &task_attr );
+ }
+
+//*************************************************************************************************
+// Задача фонового сбора журнальных данных. Уст-ва опрашиваются по очереди начиная со
+// следующего после последнего опрошенного, каждое уст-во не чаще одного раза за период
+// config.jrn_period. Запросы передаются в классе массовой передачи данных (ZB_CLASS_BULK),
+// запрашиваются записи после позиции сбора уст-ва.
+//*************************************************************************************************
+static void TaskJournal( void *pvParameters ) {
+
+    JRN_DEV *dev;
+    ZBErrorState state;
+    uint8_t ind, cnt, busy;
+    uint16_t dev_numb = 0;
+
+    for ( ;; ) {
+        osDelay( JRN_TIME_STEP );
+        //сохранение позиций сбора с задержкой после последнего изменения
+        if ( jrn_dirty == true && osKernelGetTickCount() - jrn_dirty_time >= JRN_SAVE_DELAY )
+            CursorSave();
+        if ( !config.jrn_period || config.jrn_period > JRN_PERIOD_MAX )
+            continue;
+        //команды управления и интерактивные запросы выполняются в первую очередь
+        if ( ZBSendCount( ZB_CLASS_CTRL ) || ZBSendCount( ZB_CLASS_QUERY ) ) {
+            jrn_yield++;
+            continue;
+           }
+        for ( busy = 0, ind = 0; ind < DEV_LIST_MAX; ind++ ) {
+            if ( jrn_dev[ind].busy == true )
+                busy++;
+           }
+        for ( cnt = 0; cnt < DEV_LIST_MAX && busy < JRN_REQ_MAX; cnt++ ) {
+            dev_numb = DevListNext( dev_numb );
+            if ( !dev_numb )
+                break;
+            dev = JrnFind( dev_numb, true );
+            if ( dev == NULL || dev->busy == true || (int32_t)( osKernelGetTickCount() - dev->time_next ) < 0 )
+                continue;
+            dev->busy = true;
+            dev->time_mark = osKernelGetTickCount();
+            state = ZBSendCreate( ZB_PACK_REQ_SINCE, dev_numb, JRN_RECORDS, VALVE_CTRL_NOTHING, VALVE_CTRL_NOTHING, TIME_WAIT_RTO, JournalDone, dev );
+            if ( state == ZB_ERROR_BUSY ) {
+                //очередь передачи заполнена, повтор на следующем шаге
+                dev->busy = false;
+                break;
+               }
+            dev->req++;
+            dev->time_next = dev->time_mark + config.jrn_period * 1000;
+            if ( state != ZB_ERROR_OK ) {
+                dev->busy = false;
+                dev->err++;
+                continue;
+               }
+            busy++;
+           }
+       }
+ }
+
+//*************************************************************************************************
+// Завершение запроса журнальных данных, вызывается из TaskZBCtrl()
+//-------------------------------------------------------------------------------------------------
+// ZBErrorState state - результат выполнения запроса
+// void *arg          - состояние сбора данных уст-ва
+//*************************************************************************************************
+static void JournalDone( ZBErrorState state, void *arg ) {
+
+    JRN_DEV *dev = (JRN_DEV *)arg;
+
+    if ( state != ZB_ERROR_OK )
+        dev->err++;
+    dev->busy = false;
+ }
+
+//*************************************************************************************************
+// Учет принятой журнальной записи, вызывается из TaskZBCtrl() при выводе журнальных данных.
+// Позиция сбора уст-ва смещается на дату/время записи, если запись новее позиции.
+//-------------------------------------------------------------------------------------------------
+// uint16_t dev_numb    - номер уст-ва
+// DATE_TIME *date_time - дата/время записи
+//*************************************************************************************************
+void JournalRecv( uint16_t dev_numb, DATE_TIME *date_time ) {
+
+    JRN_DEV *dev;
+    JRN_CURSOR *cursor;
+    uint32_t time;
+
+    cursor = CursorFind( dev_numb, true );
+    if ( cursor != NULL && ( !cursor->date_time.year || DtimeToSec( date_time ) > DtimeToSec( &cursor->date_time ) ) ) {
+        osKernelLock();
+        memcpy( (uint8_t *)&cursor->date_time, (uint8_t *)date_time, sizeof( DATE_TIME ) );
+        cursor_dirty[cursor - jrn_cursor] = true;
+        osKernelUnlock();
+        if ( jrn_dirty == false )
+            jrn_dirty_time = osKernelGetTickCount();
+        jrn_dirty = true;
+       }
+    dev = JrnFind( dev_numb, false );
+    if ( dev == NULL )
+        return;
+    dev->recs++;
+    //время передачи учитывается только для записей, принятых после запроса
+    time = osKernelGetTickCount() - dev->time_mark;
+    if ( time <= JRN_XFER_GAP ) {
+        dev->time_xfer += time;
+        dev->time_mark += time;
+       }
+ }
+
+//*************************************************************************************************
+// Возвращает позицию сбора журнальных данных уст-ва
+//-------------------------------------------------------------------------------------------------
+// uint16_t dev_numb    - номер уст-ва
+// DATE_TIME *date_time - указатель для размещения даты/времени последней полученной записи,
+//                        нулевое значение - записи от уст-ва не получены
+//*************************************************************************************************
+void JournalCursor( uint16_t dev_numb, DATE_TIME *date_time ) {
+
+    JRN_CURSOR *cursor;
+
+    memset( (uint8_t *)date_time, 0x00, sizeof( DATE_TIME ) );
+    cursor = CursorFind( dev_numb, false );
+    if ( cursor == NULL )
+        return;
+    osKernelLock();
+    memcpy( (uint8_t *)date_time, (uint8_t *)&cursor->date_time, sizeof( DATE_TIME ) );
+    osKernelUnlock();
+ }
+
+//*************************************************************************************************
+// Вывод состояния сбора журнальных данных по уст-вам
+//*************************************************************************************************
+void JournalStat( void ) {
+
+    uint8_t ind;
+    uint32_t rate;
+    char *ptr;
+    JRN_CURSOR *cursor;
+
+    if ( !config.jrn_period || config.jrn_period > JRN_PERIOD_MAX )
+        UartSendStr( "Journal harvester: off\r\n" );
+    else {
+        sprintf( str, "Journal harvester: every %u sec, yield: %u\r\n", config.jrn_period, jrn_yield );
+        UartSendStr( str );
+       }
+    UartSendStr( (char *)msg_str_delim );
+    for ( ind = 0; ind < DEV_LIST_MAX; ind++ ) {
+        if ( !jrn_dev[ind].dev_numb )
+            continue;
+        //скорость получения записей (записей/сек * 10)
+        rate = 0;
+        if ( jrn_dev[ind].time_xfer )
+            rate = (uint64_t)jrn_dev[ind].recs * 10000 / jrn_dev[ind].time_xfer;
+        ptr = str;
+        ptr += sprintf( ptr, "Device: %05u  Req: %u  Err: %u  ", jrn_dev[ind].dev_numb, jrn_dev[ind].req, jrn_dev[ind].err );
+        ptr += sprintf( ptr, "Records: %u  Rate: %u.%u rec/sec%s\r\n", jrn_dev[ind].recs, rate / 10, rate % 10,
+                        jrn_dev[ind].busy == true ? "  busy" : "" );
+        UartSendStr( str );
+       }
+    UartSendStr( (char *)msg_str_delim );
+    //позиции сбора журнальных данных
+    for ( ind = 0; ind < JRN_CURSOR_MAX; ind++ ) {
+        cursor = &jrn_cursor[ind];
+        if ( !cursor->dev_numb )
+            continue;
+        sprintf( str, "Device: %05u  Last record: %02u.%02u.%04u %02u:%02u:%02u\r\n", cursor->dev_numb, 
+                 cursor->date_time.day, cursor->date_time.month, cursor->date_time.year, 
+                 cursor->date_time.hour, cursor->date_time.min, cursor->date_time.sec );
+        UartSendStr( str );
+       }
+    sprintf( str, "Cursors: %s, records: %u/%u, erased: %u", jrn_dirty == true ? "not saved" : "saved",
+             jrn_rec_pos, (uint16_t)JRN_REC_MAX, jrn_erase );
+    UartSendStr( str );
+    if ( jrn_save_err ) {
+        UartSendStr( ", error: " );
+        UartSendStr( ConfigError( jrn_save_err ) );
+       }
+    UartSendStr( "\r\n" );
+    UartSendStr( (char *)msg_str_delim );
+ }
+
+//*************************************************************************************************
+// Поиск состояния сбора данных уст-ва. При добавлении, если свободной записи нет,
+// используется запись уст-ва, запрос которому выполнялся раньше остальных.
+//-------------------------------------------------------------------------------------------------
+// uint16_t dev_numb - номер уст-ва
+// bool add          - добавить уст-во, если уст-ва нет в таблице
+// return = NULL     - уст-ва нет в таблице или нет свободной записи
+//*************************************************************************************************
+static JRN_DEV *JrnFind( uint16_t dev_numb, bool add ) {
+
+    uint8_t ind;
+    JRN_DEV *dev = NULL;
+
+    if ( !dev_numb )
+        return NULL;
+    for ( ind = 0; ind < DEV_LIST_MAX; ind++ ) {
+        if ( jrn_dev[ind].dev_numb == dev_numb )
+            return &jrn_dev[ind];
+       }
+    if ( add == false )
+        return NULL;
+    for ( ind = 0; ind < DEV_LIST_MAX; ind++ ) {
+        if ( jrn_dev[ind].busy == true )
+            continue;
+        if ( !jrn_dev[ind].dev_numb ) {
+            dev = &jrn_dev[ind];
+            break;
+           }
+        if ( dev == NULL || (int32_t)( jrn_dev[ind].time_mark - dev->time_mark ) < 0 )
+            dev = &jrn_dev[ind];
+       }
+    if ( dev == NULL )
+        return NULL;
+    memset( (uint8_t *)dev, 0x00, sizeof( JRN_DEV ) );
+    dev->dev_numb = dev_numb;
+    dev->time_next = osKernelGetTickCount();
+    return dev;
+ }
+
+//*************************************************************************************************
+// Поиск позиции сбора журнальных данных уст-ва. При добавлении, если свободной позиции нет,
+// используется позиция с самой ранней датой/временем последней записи.
+//-------------------------------------------------------------------------------------------------
+// uint16_t dev_numb - номер уст-ва
+// bool add          - добавить позицию, если позиции уст-ва нет
+// return = NULL     - позиции уст-ва нет
+//*************************************************************************************************
+static JRN_CURSOR *CursorFind( uint16_t dev_numb, bool add ) {
+
+    uint8_t ind;
+    JRN_CURSOR *cursor = NULL;
+
+    if ( !dev_numb )
+        return NULL;
+    for ( ind = 0; ind < JRN_CURSOR_MAX; ind++ ) {
+        if ( jrn_cursor[ind].dev_numb == dev_numb )
+            return &jrn_cursor[ind];
+       }
+    if ( add == false )
+        return NULL;
+    for ( ind = 0; ind < JRN_CURSOR_MAX; ind++ ) {
+        if ( !jrn_cursor[ind].dev_numb || !jrn_cursor[ind].date_time.year ) {
+            cursor = &jrn_cursor[ind];
+            break;
+           }
+        if ( cursor == NULL || DtimeToSec( &jrn_cursor[ind].date_time ) < DtimeToSec( &cursor->date_time ) )
+            cursor = &jrn_cursor[ind];
+       }
+    osKernelLock();
+    memset( (uint8_t *)cursor, 0x00, sizeof( JRN_CURSOR ) );
+    cursor->dev_numb = dev_numb;
+    cursor_dirty[cursor - jrn_cursor] = true;
+    osKernelUnlock();
+    return cursor;
+ }
+
+//*************************************************************************************************
+// Чтение позиций сбора журнальных данных из FLASH памяти. Записи страницы читаются по порядку
+// до стертой области, более поздняя запись позиции заменяет предыдущую. Записи с ошибкой КС
+// пропускаются, при наличии таких записей страница будет стерта при следующем сохранении.
+//*************************************************************************************************
+static void CursorLoad( void ) {
+
+    uint16_t dw;
+    bool damaged = false;
+    JRN_REC rec;
+    uint32_t *source_addr, *dest_addr;
+
+    memset( (uint8_t *)jrn_cursor, 0x00, sizeof( jrn_cursor ) );
+    memset( (uint8_t *)cursor_dirty, 0x00, sizeof( cursor_dirty ) );
+    source_addr = (uint32_t *)FLASH_CURSOR_ADDRESS;
+    for ( jrn_rec_pos = 0; jrn_rec_pos < JRN_REC_MAX; jrn_rec_pos++ ) {
+        //читаем значение только как WORD (по 4 байта)
+        dest_addr = (uint32_t *)&rec;
+        for ( dw = 0; dw < sizeof( rec )/sizeof( uint32_t ); dw++, source_addr++, dest_addr++ )
+            *dest_addr = *(__IO uint32_t *)source_addr;
+        if ( rec.slot == 0xFF )
+            break; //стертая область страницы
+        if ( rec.slot >= JRN_CURSOR_MAX || rec.crc != CalcCRC16( (uint8_t *)&rec, offsetof( JRN_REC, crc ) ) ) {
+            damaged = true;
+            continue;
+           }
+        memcpy( (uint8_t *)&jrn_cursor[rec.slot], (uint8_t *)&rec.cursor, sizeof( JRN_CURSOR ) );
+       }
+    if ( damaged == true )
+        jrn_rec_pos = JRN_REC_MAX;
+ }
+
+//*************************************************************************************************
+// Сохранение позиций сбора журнальных данных в FLASH памяти. Измененные позиции дописываются
+// в стертую область страницы, если места не достаточно - страница стирается и записываются
+// все используемые позиции. При ошибке записи позиции будут сохранены повторно со стиранием.
+//*************************************************************************************************
+static void CursorSave( void ) {
+
+    static JRN_REC rec[JRN_CURSOR_MAX];
+    bool erase;
+    uint8_t ind, cnt;
+    uint32_t addr;
+
+    //копия позиций: позиции изменяются в TaskZBCtrl()
+    osKernelLock();
+    for ( cnt = 0, ind = 0; ind < JRN_CURSOR_MAX; ind++ ) {
+        if ( cursor_dirty[ind] == true )
+            cnt++;
+       }
+    erase = ( jrn_rec_pos + cnt > JRN_REC_MAX ) ? true : false;
+    for ( cnt = 0, ind = 0; ind < JRN_CURSOR_MAX; ind++ ) {
+        if ( cursor_dirty[ind] == false && ( erase == false || !jrn_cursor[ind].dev_numb ) )
+            continue;
+        cursor_dirty[ind] = false;
+        rec[cnt].slot = ind;
+        memcpy( (uint8_t *)&rec[cnt].cursor, (uint8_t *)&jrn_cursor[ind], sizeof( JRN_CURSOR ) );
+        cnt++;
+       }
+    jrn_dirty = false;
+    osKernelUnlock();
+    for ( ind = 0; ind < cnt; ind++ )
+        rec[ind].crc = CalcCRC16( (uint8_t *)&rec[ind], offsetof( JRN_REC, crc ) );
+    if ( erase == true )
+        jrn_rec_pos = 0;
+    addr = FLASH_CURSOR_ADDRESS + jrn_rec_pos * sizeof( JRN_REC );
+    jrn_save_err = FlashWrite( addr, (uint32_t *)rec, cnt * sizeof( JRN_REC ), erase );
+    if ( erase == true )
+        jrn_erase++;
+    if ( !jrn_save_err ) {
+        jrn_rec_pos += cnt;
+        return;
+       }
+    //повторное сохранение всех позиций со стиранием страницы
+    osKernelLock();
+    for ( ind = 0; ind < cnt; ind++ )
+        cursor_dirty[rec[ind].slot] = true;
+    osKernelUnlock();
+    jrn_rec_pos = JRN_REC_MAX;
+    jrn_dirty_time = osKernelGetTickCount();
+    jrn_dirty = true;
+ }
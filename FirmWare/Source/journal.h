@@ -0,0 +1,20 @@
+
+#ifndef __JOURNAL_H
+#define __JOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "xtime.h"
+
+#define JRN_PERIOD_MAX          3600            //максимальный период сбора журнальных данных (сек)
+
+//*************************************************************************************************
+// Функции управления
+//*************************************************************************************************
+void JournalInit( void );
+void JournalRecv( uint16_t dev_numb, DATE_TIME *date_time );
+void JournalCursor( uint16_t dev_numb, DATE_TIME *date_time );
+void JournalStat( void );
+
+#endif
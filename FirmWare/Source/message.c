@@ -24,6 +24,8 @@ const char msg_save[]       = "\r\nSaving parameters: ";
 const char msg_no_command[] = "\r\nUnknown command.";
 const char msg_err_param[]  = "\r\nInvalid parameters.\r\n\r\n";
 const char msg_err_dev[]    = "\r\nDevice not found.\r\n\r\n";
+const char msg_wlog_busy[]  = "\r\nLog window transfer in progress.\r\n\r\n";
+const char msg_zbgap_idle[] = "\r\nEnd of frame is detected by UART IDLE, zbgap is not used.\r\n\r\n";
 const char msg_zb_read[]    = "ZB: read config ...";
 const char msg_zb_save[]    = "ZB: save config ...";
 const char msg_send_res[]   = "\r\nTransmission result: ";
@@ -12,6 +12,8 @@ extern const char msg_save[];
 extern const char msg_no_command[];
 extern const char msg_err_param[];
 extern const char msg_err_dev[];
+extern const char msg_wlog_busy[];
+extern const char msg_zbgap_idle[];
 extern const char msg_send_res[];
 extern const char msg_zb_read[];
 extern const char msg_zb_save[];
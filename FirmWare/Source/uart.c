@@ -259,6 +259,19 @@ uint32_t UartGetSpeed( UARTSpeed speed ) {
     else return 0;
  }
 
+//*************************************************************************************************
+// Возвращает длительность передачи одного байта по ID скорости обмена
+//-------------------------------------------------------------------------------------------------
+// UARTSpeed speed - ID скорости обмена
+// return          - длительность передачи байта (мкс)
+//*************************************************************************************************
+uint32_t UartByteTime( UARTSpeed speed ) {
+
+    if ( speed < SIZE_ARRAY( uart_speed ) )
+        return uart_speed[speed][2];
+    else return 0;
+ }
+
 //*************************************************************************************************
 // Проверка значения baud на допустимое значение скорости обмена.
 // При успешной проверке в speed возвращается ID скорости обмена
@@ -32,6 +32,7 @@ void UartRecvComplt( void );
 void UartSendComplt( void );
 char *UartBuffer( void );
 uint32_t UartGetSpeed( UARTSpeed speed );
+uint32_t UartByteTime( UARTSpeed speed );
 ErrorStatus CheckBaudRate( uint32_t baud, UARTSpeed *speed );
 
 #endif
@@ -45,9 +45,6 @@ static char * const dows_short[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "
 //*************************************************************************************************
 // Прототипы локальных функций
 //*************************************************************************************************
-static void SecToDtime( uint32_t secsarg, DATE_TIME *ptr );
-static uint32_t DtimeToSec( DATE_TIME *ptr );
-
 static ErrorStatus RTC_EnterInitMode( RTC_HandleTypeDef *hrtc ); 
 static ErrorStatus RTC_ExitInitMode( RTC_HandleTypeDef *hrtc );
 
@@ -103,7 +100,7 @@ ErrorStatus SetTimeDate( DATE_TIME *ptr ) {
 // uint32_t secsarg - кол-во секунд прошедших от TBIAS_YEAR года
 // struct tm *ptr   - указатель на структуру содежащую значение дата/время после расчета 
 //*************************************************************************************************
-static void SecToDtime( uint32_t secsarg, DATE_TIME *ptr ) {
+void SecToDtime( uint32_t secsarg, DATE_TIME *ptr ) {
 
     uint32_t i, secs, days, mon, year;
     const uint16_t *pm;
@@ -135,7 +132,7 @@ static void SecToDtime( uint32_t secsarg, DATE_TIME *ptr ) {
 // struct timedate *ptr - структура содежащая текущее значение время-дата
 // return               - значение кол-ва секунд
 //*************************************************************************************************
-static uint32_t DtimeToSec( DATE_TIME *ptr ) {
+uint32_t DtimeToSec( DATE_TIME *ptr ) {
 
     uint32_t days, secs, mon, year;
  
@@ -33,6 +33,8 @@ typedef struct {
 //*************************************************************************************************
 void GetTimeDate( DATE_TIME *ptr );
 ErrorStatus SetTimeDate( DATE_TIME *ptr );
+void SecToDtime( uint32_t secsarg, DATE_TIME *ptr );
+uint32_t DtimeToSec( DATE_TIME *ptr );
 uint8_t DayOfWeek( uint8_t day, uint8_t month, uint16_t year );
 ErrorStatus TimeSet( char *time );
 ErrorStatus DateSet( char *date );
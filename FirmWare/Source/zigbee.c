@@ -26,9 +26,13 @@
 #include "zigbee.h"
 
 #define DEBUG_ZIGBEE            0           //вывод принятых/отправленных пакетов в HEX формате
-#define DEBUG_MALLOC            0           //вывод отладочной информации для pvPortMalloc()
+#define DEBUG_POOL              0           //вывод отладочной информации о занятии ячеек пула
+#define DEBUG_LINE              32          //кол-во байт в строке отладочного вывода пакета
 
 #define NET_STATUS_SOFT         1           //програмнное определение статуса сети
+#define ZB_TASK_REACTOR         1           //прием, разбор пакетов и отправка подтверждений 
+                                            //в одной задаче TaskZBCtrl(), при значении "0" - 
+                                            //разбор пакетов в отдельной задаче TaskZBFlow()
 
 //*************************************************************************************************
 // Внешние переменные
@@ -46,8 +50,11 @@ ZB_CONFIG zb_cfg;
 // Локальные константы
 //*************************************************************************************************
 #define BUFFER_CMD              80          //размер буфера для команд управления
-#define BUFF_RECV_SIZE          512         //размер буферов приема
-#define BUFF_SEND_SIZE          128         //размер буферов передачи
+#define BUFF_RECV_SIZE          512         //размер ячейки приема: блок пакетов, завершаемый
+                                            //по паузе, может содержать пакеты нескольких уст-в
+#define BUFF_DMA_SIZE           256         //размер циклического буфера приема DMA
+#define RECV_SLOT_CNT           8           //кол-во ячеек пула принятых пакетов (степень 2)
+#define RECV_SLOT_NONE          0xFF        //признак отсутствия ячейки пула для приема
 
 #define ZB_SEND_DATA            0xFC        //код команды передачи данных
 #define ZB_SYS_CONFIG           0xFB        //ответ чтения конфигурации
@@ -55,10 +62,30 @@ ZB_CONFIG zb_cfg;
 #define OFFSET_DATA_SIZE        1           //смещение для размещения размера пакета
 #define ZB_ADDR_SIZE            2           //размер адреса шлюза (координатора)
 #define ZB_MODE_SIZE            2           //кол-во байт определяюшие тип передачи пакета
+#define SEND_REQ_CNT            8           //кол-во ячеек пула запросов на передачу
+#define SEND_REQ_NONE           0xFF        //признак отсутствия запроса
+#define SEND_REQ_RESERVE        2           //кол-во ячеек пула запросов, недоступных для 
+                                            //запросов класса ZB_CLASS_BULK
+#define SEND_FRAME_HEAD         ( 4 + ZB_ADDR_SIZE ) 
+                                            //заголовок пакета передачи данных уст-ву: 4 байта 
+                                            //команды передачи + адрес получателя
+#define SEND_DATA_SIZE          ( BUFFER_CMD - SEND_FRAME_HEAD )
+                                            //максимальный размер данных в запросе на передачу
+#define FLAG_SEND_SYNC          0x0001      //флаг задачи: синхронный запрос выполнен
 
 #define TIME_DELAY_RESET        100         //задержка восстановления сигнала сброса (msec)
 #define TIME_DELAY_ANSWER       100         //ожидание ответа (msec)
 #define TIME_DELAY_CHECK        700         //задержка проверки включения ZigBee модуля (msec)
+#define TIME_SEND_RETRY         10          //интервал повтора передачи запроса, если 
+                                            //ZigBee модуль занят другой задачей (msec)
+#define SEND_RETRY_MAX          3           //максимальное кол-во повторных передач запроса
+#define TIME_RETRY_BASE         100         //начальная задержка повторной передачи (msec), 
+                                            //удваивается при каждом повторе
+#define TIME_RETRY_MAX          2000        //максимальная задержка повторной передачи (msec)
+#define RETRY_AIR_WINDOW        10000       //интервал ограничения эфирного времени повторов (msec)
+#define RETRY_AIR_BYTES         1024        //максимальный объем повторных передач за интервал (байт)
+#define ACK_WAIT_CNT            4           //кол-во отложенных подтверждений (нет свободной ячейки 
+                                            //пула запросов), повтор выполняется из SendProc()
 
 #define OFFSET_CFG_DATA         3           //смещения для размещения параметров
                                             //конфигурации ZigBee модуля
@@ -68,7 +95,8 @@ typedef struct {
     ZBCmnd       id_command;                //ID команды
     uint8_t      code_command[4];           //коды команды
     uint16_t     time_answer;               //время ожидаемого ответа (msec)
-    ZBErrorState (*func_exec)( void *ptr ); //указатель на функцию исполнения команды
+    ZBAnswer     id_answer;                 //ожидаемый ответ модуля (из набора zb_answr[])
+    uint8_t      (*func_exec)( void *ptr, uint8_t *data ); //указатель на функцию формирования команды
  } ZB_COMMAND;
 
 //Структура стандартных ответов ZigBee модуля
@@ -77,11 +105,66 @@ typedef struct {
     uint8_t      code_answer[2];            //коды ответа
  } ZB_ANSWER;
 
-//
+//Ячейка пула принятых пакетов, в очереди передается только индекс ячейки
+typedef struct {
+    uint16_t    len;                        //размер принятых данных
+    bool        checked;                    //ячейка содержит один пакет, размер/КС которого
+                                            //проверены при приеме (см. RecvCheck())
+    uint8_t     data[BUFF_RECV_SIZE];       //принятые данные
+ } RECV_SLOT;
+
+//Ячейка пула запросов на передачу пакета уст-ву, в очереди передается только индекс ячейки.
+//Пакет формируется в ячейке со смещением SEND_FRAME_HEAD, заголовок заполняется при 
+//добавлении запроса в очередь, передача по DMA выполняется непосредственно из ячейки
+typedef struct {
+    uint8_t         frame[BUFFER_CMD];      //заголовок + данные пакета
+    uint8_t         len;                    //размер данных пакета (без заголовка)
+    uint8_t         size;                   //размер передаваемого кадра (заголовок + данные)
+    ZBAnswer        sys;                    //ожидаемый ответ модуля на команду управления,
+                                            //ZB_ANS_UNDEF - запрос передачи пакета уст-ву
+    uint16_t        addr;                   //адрес уст-ва в сети
+    uint16_t        time_answ;              //время ожидания ответа (msec), "0" - без ожидания,
+                                            //TIME_WAIT_RTO - по оценке времени ответа уст-ва
+    ZBSendCallBack  callback;               //функция завершения запроса
+    void            *arg;                   //параметр функции завершения запроса
+    uint16_t        dev_numb;               //номер уст-ва       } ключ сопоставления 
+    ZBTypePack      answ;                   //ожидаемый тип ответа } ответа с запросом
+    uint32_t        deadline;               //время окончания ожидания ответа (tick)
+    uint32_t        time_send;              //время окончания передачи запроса (tick)
+    uint32_t        time_recv;              //время получения ответа (tick)
+    uint8_t         tries;                  //кол-во передач запроса
+    volatile bool   retry;                  //ожидание повторной передачи до deadline
+    volatile bool   queued;                 //запрос повторно добавлен в очередь msg_send
+    ZBSendClass     cls;                    //класс приоритета запроса
+    uint32_t        time_post;              //время добавления запроса в очередь (tick)
+    volatile bool   used;                   //ячейка занята запросом
+    bool            follow;                 //запрос присоединен к такому же выполняемому запросу
+    uint8_t         next;                   //следующий присоединенный запрос, SEND_REQ_NONE - нет
+    volatile bool   pend;                   //запрос передан, ожидается ответ
+    volatile bool   done;                   //ответ на запрос получен
+    volatile ZBErrorState state;            //результат проверки ответа
+ } SEND_REQ;
+
+//Ограничитель скорости передачи (token bucket), запас хранится в масштабе 1000 для 
+//пополнения с точностью 1 ms, емкость ограничителя - объем передачи за 1 сек
+typedef struct {
+    uint32_t        bytes;                  //запас байт (x1000)
+    uint32_t        frames;                 //запас пакетов (x1000)
+    uint32_t        tick;                   //время последнего пополнения (tick)
+ } RATE_BUCKET;
+
+//Отложенное подтверждение получения журнальных данных
+typedef struct {
+    ZBTypePack      type;                   //тип подтверждения, ZB_PACK_UNDEF - ячейка свободна
+    uint16_t        dev_numb;               //номер уст-ва
+    uint8_t         seq;                    //номер подтверждаемой записи (ZB_PACK_ACK_WIN)
+ } ACK_WAIT;
+
+//Параметры синхронного запроса ZBControl()
 typedef struct {
-    void        *ptr;                       //указатель на буфер
-    uint16_t    len;                        //размер буфера
- } RECV_DATA;
+    osThreadId_t    thread;                 //задача, ожидающая завершения запроса
+    ZBErrorState    state;                  //результат выполнения запроса
+ } SEND_SYNC;
 
 //Расшифровка результата выполнения команд
 static char * const error_descr[] = {
@@ -98,9 +181,48 @@ static char * const error_descr[] = {
                                             //не соответствует номеру полученному в пакете данных)
     "Device address error",                 //ошибка в адресе (адрес, присвоенный при подключении к 
                                             //сети не соответствует адресу полученному в пакете)
+    "Send queue is full",                   //очередь запросов на передачу заполнена
     "Module response not identified"        //ответ модуля (тип пакета данных) не идентифицирован
  };
 
+//Расшифровка дополнительных счетчиков статистики
+static char * const stat_descr[] = {
+    "Frame pool slots used",                //кол-во занятых ячеек пула
+    "Frame pool slots max used",            //максимальное кол-во занятых ячеек пула
+    "Frames dropped, no free slot",         //кол-во потерянных пакетов, нет свободной ячейки пула
+    "Resynchronization after bad data",     //кол-во восстановлений разбора после ошибки в данных
+    "Bytes skipped on resynchronization",   //кол-во пропущенных байт при поиске начала пакета
+    "Frame size not confirmed, wait idle",  //кол-во пакетов известного размера с ошибкой КС при приеме
+    "Receive buffer overflow",              //кол-во переполнений буфера приема
+    "Frames dropped, total",                //общее кол-во отброшенных при приеме пакетов
+    "UART receive errors",                  //кол-во ошибок приема UART
+    "Frames ready, max waiting",            //максимальное кол-во принятых пакетов, ожидающих разбора
+    "Send retries",                         //кол-во повторных передач запросов
+    "Send retries succeeded",               //кол-во запросов, выполненных после повторной передачи
+    "Send retries denied, device budget",   //кол-во отказов в повторе: исчерпан лимит повторов уст-ва
+    "Send retries denied, airtime cap",     //кол-во отказов в повторе: превышено эфирное время
+    "Send control requests",                //кол-во переданных запросов класса ZB_CLASS_CTRL
+    "Send query requests",                  //кол-во переданных запросов класса ZB_CLASS_QUERY
+    "Send bulk requests",                   //кол-во переданных запросов класса ZB_CLASS_BULK
+    "Send control max wait (ms)",           //максимальное время ожидания передачи ZB_CLASS_CTRL
+    "Send query max wait (ms)",             //максимальное время ожидания передачи ZB_CLASS_QUERY
+    "Send bulk max wait (ms)",              //максимальное время ожидания передачи ZB_CLASS_BULK
+    "Send control total wait (ms)",         //суммарное время ожидания передачи ZB_CLASS_CTRL
+    "Send query total wait (ms)",           //суммарное время ожидания передачи ZB_CLASS_QUERY
+    "Send bulk total wait (ms)",            //суммарное время ожидания передачи ZB_CLASS_BULK
+    "Send deferred by rate limit",          //кол-во отложенных передач: превышено ограничение скорости
+    "Send rejected by rate limit",          //кол-во отклоненных передач: превышено ограничение скорости
+    "Send requests coalesced",              //кол-во запросов, присоединенных к такому же запросу
+    "Module errors not matched to request", //кол-во ответов модуля об ошибке без сопоставления
+    "ACK deferred, no free send slot",      //кол-во отложенных подтверждений
+    "ACK dropped, defer table full"         //кол-во потерянных подтверждений
+ };
+
+//Наименования и значения по умолчанию ограничителей скорости передачи (по индексу ограничителя)
+static char * const rate_descr[] = { "ctrl", "query", "bulk", "bcast" };
+static const uint16_t rate_bytes[] = { 512, 512, 256, 64 };     //байт/сек
+static const uint8_t rate_frames[] = { 8, 8, 4, 1 };            //пакетов/сек
+
 static char * const dev_type[] = {
     "Coordinator", "Router", "Terminal"
  };
@@ -135,7 +257,13 @@ static char * const desc_pack[] = {
     "PACK_REQ_VALVE",
     "PACK_REQ_DATA",
     "PACK_CTRL_VALVE",
-    "PACK_ACK"
+    "PACK_ACK",
+    "PACK_WLOG_SEQ",
+    "PACK_REQ_WLOG",
+    "PACK_ACK_WIN",
+    "PACK_WLOG_BATCH",
+    "PACK_REQ_BATCH",
+    "PACK_REQ_SINCE"
  };
 #endif
                                                                     
@@ -144,8 +272,8 @@ static char * const txpower[] = { "-3/16/20", "-1.5/17/22", "0/19/24", "2.5/20/2
 //*************************************************************************************************
 // Прототипы локальных функций вызываемые по ссылке
 //*************************************************************************************************
-static ZBErrorState SetCfg( void *ptr );
-static ZBErrorState Command( void *ptr );
+static uint8_t SetCfg( void *ptr, uint8_t *data );
+static uint8_t Command( void *ptr, uint8_t *data );
 
 //*************************************************************************************************
 // Локальные переменные
@@ -157,28 +285,54 @@ static char str2[180];
 
 static ZBAnswer chk_answ;
 static ZBTypePack chk_pack;
-static DATA_ACK data_ack;
 static bool time_out = false;
-static osTimerId_t timer_start;
+static osTimerId_t timer_start, timer_reset;
 static osMutexId_t zb_mutex = NULL;
-static osMessageQueueId_t msg_recv = NULL;
+static osMessageQueueId_t msg_recv = NULL, msg_free = NULL;
+static osMessageQueueId_t msg_send[ZB_CLASS_CNT], msg_send_free = NULL;
+static osThreadId_t zb_task = NULL;
 static osSemaphoreId_t sem_send = NULL, sem_ans = NULL;
 static osEventFlagsId_t zb_init = NULL, zb_ctrl = NULL;
 
-static uint16_t recv_ind = 0;
+static bool recv_skip = false;             //признак: принимаемый пакет будет отброшен
+static uint16_t recv_ind = 0;               //кол-во принятых байт текущего пакета
+static uint16_t recv_size = 0;              //ожидаемый размер текущего пакета, "0" - не известен
+static uint8_t recv_cur = RECV_SLOT_NONE;   //ячейка пула, в которую выполняется прием
+//очередь заполненных ячеек пула: запись индекса ready_head только в прерывании,
+//чтение индекса ready_tail только в TaskZBCtrl(), блокировка не требуется
+static volatile uint8_t ready_head = 0, ready_tail = 0;
+static uint8_t ready_ring[RECV_SLOT_CNT];
+static uint8_t frame_size[256];             //размер пакета по значению первого байта пакета
+                                            //"0" - размер не известен
 static uint32_t send_cnt = 0, recv_cnt = 0;
 static uint32_t error_cnt[SIZE_ARRAY( error_descr )]; //счетчики ошибок
+static uint32_t stat_cnt[SIZE_ARRAY( stat_descr )];   //дополнительные счетчики статистики
+static RECV_SLOT recv_slot[RECV_SLOT_CNT];            //пул принятых пакетов
+static SEND_REQ send_req[SEND_REQ_CNT];               //пул запросов на передачу
+static volatile uint8_t send_last = SEND_REQ_NONE;  //единственный запрос последней пакетной передачи,
+                                                      //которому может относиться ответ модуля об ошибке
+static uint8_t tx_ring[SEND_REQ_CNT];                 //очередь пакетной передачи (индексы запросов)
+static volatile uint8_t tx_cnt = 0;                   //кол-во пакетов в очереди пакетной передачи
+static volatile uint8_t tx_done = 0;                  //кол-во переданных пакетов из очереди
+static uint32_t retry_air_start = 0;                  //начало интервала учета эфирного времени повторов
+static uint32_t retry_air_bytes = 0;                  //объем повторных передач за интервал (байт)
+static uint32_t retry_seed = 0;                       //состояние генератора случайной задержки
+static RATE_BUCKET rate_bkt[ZB_RATE_CNT];             //ограничители скорости передачи
+static ACK_WAIT ack_wait[ACK_WAIT_CNT];               //отложенные подтверждения
 static uint8_t recv, buff_data[BUFFER_CMD]; 
-static uint8_t recv_buff[BUFF_RECV_SIZE], send_buff[BUFF_SEND_SIZE];
+#if RECV_MODE_DMA == 1
+static uint16_t dma_pos = 0;                //позиция чтения данных из циклического буфера DMA
+static uint8_t dma_buff[BUFF_DMA_SIZE];
+#endif
 
 //Набор команд управления модулем ZigBee
 static ZB_COMMAND zb_cmd[] = {
-    //код команды, коды команды, время ожидания ответа, функция вызова
-    { ZB_CMD_READ_CONFIG,   { 0xFE, 0x01, 0xFE, 0xFF }, 100, Command }, //чтение конфигурации
-    { ZB_CMD_SAVE_CONFIG,   { 0xFD, 0x2E, 0xFE, 0xFF }, 200, SetCfg  }, //запись конфигурации
-    { ZB_CMD_DEV_INIT,      { 0xFD, 0x01, 0x12, 0xFF }, 100, Command }, //перезапуск модуля
-    { ZB_CMD_DEV_FACTORY,   { 0xFD, 0x01, 0x13, 0xFF }, 100, Command }, //установка заводских настроек
-    { ZB_CMD_NET_RESTART,   { 0xFD, 0x01, 0x14, 0xFF }, 100, Command }  //переподключение к сети
+    //код команды, коды команды, время ожидания ответа, ожидаемый ответ, функция вызова
+    { ZB_CMD_READ_CONFIG,   { 0xFE, 0x01, 0xFE, 0xFF }, 100, ZB_ANS_READ_CONFIG, Command }, //чтение конфигурации
+    { ZB_CMD_SAVE_CONFIG,   { 0xFD, 0x2E, 0xFE, 0xFF }, 200, ZB_ANS_SET_CONFIG,  SetCfg  }, //запись конфигурации
+    { ZB_CMD_DEV_INIT,      { 0xFD, 0x01, 0x12, 0xFF }, 100, ZB_ANS_RESTART,     Command }, //перезапуск модуля
+    { ZB_CMD_DEV_FACTORY,   { 0xFD, 0x01, 0x13, 0xFF }, 100, ZB_ANS_CFG_FACTORY, Command }, //установка заводских настроек
+    { ZB_CMD_NET_RESTART,   { 0xFD, 0x01, 0x14, 0xFF }, 100, ZB_ANS_NET_RESTART, Command }  //переподключение к сети
    };
 
 //Набор ответов модуля ZigBee (для HEX режима обмена данными)
@@ -197,22 +351,50 @@ static ZB_ANSWER zb_answr[] = {
 // Прототипы локальных функций
 //*************************************************************************************************
 static void TaskZBInit( void *pvParameters );
+#if ZB_TASK_REACTOR == 0
 static void TaskZBFlow( void *pvParameters );
+#endif
 static void TaskZBCtrl( void *pvParameters );
+static void RecvFrame( uint8_t slot );
+static void SendAck( PACK_RESULT *pack );
+static void AckQueue( ZBTypePack type, uint16_t dev_numb, uint8_t seq );
+static void AckIdle( void );
+static ZBErrorState AckPost( ZBTypePack type, uint16_t dev_numb, uint8_t seq );
+static bool AckRetry( void );
+static uint32_t SendProc( void );
+static void SendDone( uint8_t ind, ZBErrorState state );
+static void SendMatch( ZBTypePack answ, uint16_t dev_numb, ZBErrorState state );
+static void SendMatchSys( ZBAnswer answ );
+static bool SendBusy( SEND_REQ *req );
+static int32_t SendRetry( SEND_REQ *req );
+static void SendSync( ZBErrorState state, void *arg );
+static ZBErrorState SendPost( uint8_t ind, uint8_t len, uint16_t addr, uint16_t time_answ, ZBSendCallBack callback, void *arg );
+static ZBSendClass SendClass( SEND_REQ *req );
+static bool SendIsAck( SEND_REQ *req );
+static bool SendAttach( uint8_t ind );
+static uint32_t RateTake( uint8_t ind, uint8_t len );
+static ZBErrorState SendReady( void );
+static uint8_t SendChain( void );
 static void Timer1Callback( void *arg );
+static void Timer2Callback( void *arg );
 static ZBErrorState SendData( ZBCmnd cmnd, uint8_t *data, uint8_t len, uint16_t timeout );
 static ErrorStatus DevStatus( ZBDevState type );
 static ZBErrorState GetAnswer( void );
-static ZBAnswer CheckAnswer( uint8_t *answer, uint8_t len );
-static void ClearRecv( void );
+static ZBAnswer CheckAnswer( uint8_t *answer, uint16_t len );
+static void StartRecv( void );
+static void RecvCopy( uint8_t *data, uint16_t len );
+static void RecvClose( void );
+static bool RecvCheck( void );
+static void FrameSizeInit( void );
 static void ErrorClr( void );
+static void PoolUsed( void );
 
 static char *DevType( ZBDevType dev );
 static char *NwkState( ZBNetState state );
 static char *TxPower( ZBTxPower id_pwr );
 
 #if ( DEBUG_ZIGBEE == 1 ) && defined( DEBUG_TARGET )
-static void SendDebug( ZBDebugMode type, uint8_t *data, uint8_t len );
+static void SendDebug( ZBDebugMode type, uint8_t *data, uint16_t len );
 static char *AnswDesc( ZBAnswer id_answ );
 static char *PackDesc( ZBTypePack id_pack );
 #endif
@@ -226,15 +408,24 @@ static const osThreadAttr_t task1_attr = {
     .priority = osPriorityNormal
  };
 
+#if ZB_TASK_REACTOR == 0
 static const osThreadAttr_t task2_attr = {
     .name = "ZBFlow", 
     .stack_size = 768,
     .priority = osPriorityNormal
  };
+#endif
 
+//при ZB_TASK_REACTOR = 1 в задаче выполняется разбор и вывод принятых пакетов (ранее TaskZBFlow)
+//наибольшая глубина стека по графу вызовов: TaskZBCtrl -> OutData -> OutBatch -> WaterData ->
+//sprintf() ~730 байт + 64 байта контекста, запас ~20%, проверяется командой "task"
 static const osThreadAttr_t task3_attr = {
     .name = "ZBCtrl", 
+    #if ZB_TASK_REACTOR == 1
+    .stack_size = 1024,
+    #else
     .stack_size = 768,
+    #endif
     .priority = osPriorityNormal
  };
 
@@ -242,41 +433,71 @@ static const osSemaphoreAttr_t sem1_attr = { .name = "ZBSemSend" };
 static const osSemaphoreAttr_t sem2_attr = { .name = "ZBSemAns" };
 static const osEventFlagsAttr_t evn1_attr = { .name = "ZBEvents1" };
 static const osEventFlagsAttr_t evn2_attr = { .name = "ZBEvents2" };
+#if ZB_TASK_REACTOR == 0
 static const osMessageQueueAttr_t que_attr = { .name = "Recv" };
+#endif
+static const osMessageQueueAttr_t que_free_attr = { .name = "RecvFree" };
+static const osMessageQueueAttr_t que_send_attr[ZB_CLASS_CNT] = { 
+    { .name = "SendCtrl" }, { .name = "SendQuery" }, { .name = "SendBulk" } 
+ };
+static const osMessageQueueAttr_t que_send_free_attr = { .name = "SendFree" };
 static const osTimerAttr_t timer1_attr = { .name = "ZBTimer1" };
-static const osMutexAttr_t mutex_attr = { .name = "ZBBee", .attr_bits = osMutexPrioInherit };
+static const osTimerAttr_t timer2_attr = { .name = "ZBTimer2" };
+static const osMutexAttr_t mutex_attr = { .name = "ZBBee", .attr_bits = osMutexPrioInherit | osMutexRecursive };
 
 //*************************************************************************************************
 // Инициализация задачи и очереди событий управления модулем ZigBee
 //*************************************************************************************************
 void ZBInit( void ) {
 
+    uint8_t slot;
+    ZBSendClass cls;
+
     ErrorClr();
     DevListClr();
     GetAnswer();
+    FrameSizeInit();
     //очередь событий
     zb_init = osEventFlagsNew( &evn1_attr );
     zb_ctrl = osEventFlagsNew( &evn2_attr );
     //таймер интервалов
     timer_start = osTimerNew( Timer1Callback, osTimerOnce, NULL, &timer1_attr );
+    timer_reset = osTimerNew( Timer2Callback, osTimerOnce, NULL, &timer2_attr );
     //семафоры блокировки
     sem_send = osSemaphoreNew( 1, 0, &sem1_attr );
     sem_ans = osSemaphoreNew( 1, 0, &sem2_attr );
     //мьютех ожидания завершения цикла работы
     zb_mutex = osMutexNew( &mutex_attr );
-    //очередь сообщений
-    msg_recv = osMessageQueueNew( 32, sizeof( RECV_DATA ), &que_attr );
+    //очередь принятых пакетов и очередь свободных ячеек пула (передаются индексы ячеек),
+    //при ZB_TASK_REACTOR = 1 пакеты разбираются в TaskZBCtrl() без очереди msg_recv
+    #if ZB_TASK_REACTOR == 0
+    msg_recv = osMessageQueueNew( RECV_SLOT_CNT, sizeof( uint8_t ), &que_attr );
+    #endif
+    msg_free = osMessageQueueNew( RECV_SLOT_CNT, sizeof( uint8_t ), &que_free_attr );
+    for ( slot = 0; slot < RECV_SLOT_CNT; slot++ )
+        osMessageQueuePut( msg_free, &slot, 0, 0 );
+    //очередь запросов на передачу и очередь свободных ячеек пула запросов
+    for ( cls = ZB_CLASS_CTRL; cls < ZB_CLASS_CNT; cls++ )
+        msg_send[cls] = osMessageQueueNew( SEND_REQ_CNT, sizeof( uint8_t ), &que_send_attr[cls] );
+    msg_send_free = osMessageQueueNew( SEND_REQ_CNT, sizeof( uint8_t ), &que_send_free_attr );
+    for ( slot = 0; slot < SEND_REQ_CNT; slot++ )
+        osMessageQueuePut( msg_send_free, &slot, 0, 0 );
     //создаем задачу
     osThreadNew( TaskZBInit, NULL, &task1_attr );
+    #if ZB_TASK_REACTOR == 0
     osThreadNew( TaskZBFlow, NULL, &task2_attr );
-    osThreadNew( TaskZBCtrl, NULL, &task3_attr );
+    #endif
+    zb_task = osThreadNew( TaskZBCtrl, NULL, &task3_attr );
+    //длительность паузы окончания пакета для текущей скорости обмена с модулем
+    ZBRecvTimeout();
+    #if RECV_MODE_DMA == 0
     //т.к. при выполнении HAL_TIM_Base_Start_IT() почти сразу формируется прерывание
     //вызов HAL_TIM_Base_Start_IT() выполняем только один раз, дальнейшее управление
     //TIMER2 выполняется через __HAL_TIM_ENABLE()/__HAL_TIM_DISABLE()
     HAL_TIM_Base_Start_IT( &htim6 );
+    #endif
     //запуск приема
-    ClearRecv();
-    HAL_UART_Receive_IT( &huart3, (uint8_t *)&recv, sizeof( recv ) );
+    StartRecv();
  }
 
 //*************************************************************************************************
@@ -301,50 +522,85 @@ static void TaskZBInit( void *pvParameters ) {
        }
  }
  
+#if ZB_TASK_REACTOR == 1
 //*************************************************************************************************
-// Задача управления ZigBee модулем
+// Задача обмена с ZigBee модулем: прием, разбор принятых пакетов, передача запросов из 
+// очереди msg_send (в т.ч. подтверждений) и контроль времени ожидания ответов на них.
+// Заполненные в прерывании ячейки пула разбираются сразу, без передачи в очередь msg_recv.
 //*************************************************************************************************
 static void TaskZBCtrl( void *pvParameters ) {
 
     int32_t event;
-    void *mem_addr;
-    uint8_t *data, len;
-    RECV_DATA recv_data;
+    uint8_t slot;
+    uint32_t wait = osWaitForever;
 
     for ( ;; ) {
-        event = osEventFlagsWait( zb_ctrl, EVN_ZC_MASK, osFlagsWaitAny, osWaitForever );
+        event = osEventFlagsWait( zb_ctrl, EVN_ZC_MASK, osFlagsWaitAny, wait );
+        if ( event < 0 )
+            event = 0; //вышло время ожидания ответа на запрос или повтора передачи
         if ( event & EVN_ZC_RECV_CHECK ) {
             //индикация о принятии пакета
             osEventFlagsSet( chk_event, EVN_LED_ZB_ACTIVE );
-            //выделяем блок памяти для размещения принятых данных
-            mem_addr = pvPortMalloc( recv_ind );
-            if ( mem_addr != NULL ) {
-                recv_data.len = recv_ind;
-                recv_data.ptr = mem_addr;
-                memcpy( (uint8_t *)mem_addr, recv_buff, recv_ind );
-                osMessageQueuePut( msg_recv, &recv_data, NULL, osWaitForever );
-                #if ( DEBUG_MALLOC == 1 ) && defined( DEBUG_TARGET )
-                sprintf( str, "Allocate: %u, free: %u\r\n", recv_ind, xPortGetFreeHeapSize() );
+            //разбор заполненных в прерывании ячеек пула
+            while ( ready_tail != ready_head ) {
+                slot = ready_ring[ready_tail & ( RECV_SLOT_CNT - 1 )];
+                ready_tail++;
+                PoolUsed();
+                #if ( DEBUG_POOL == 1 ) && defined( DEBUG_TARGET )
+                sprintf( str, "Slot: %u, size: %u, used: %u\r\n", slot, recv_slot[slot].len, stat_cnt[ZB_STAT_POOL_USED] );
                 UartSendStr( str );
                 #endif
+                RecvFrame( slot );
                }
-            else {
-                sprintf( str, "Memory allocation error: %u, free: %u\r\n", recv_ind, xPortGetFreeHeapSize() ); 
+           }
+        //секундное событие: время последнего обновления данных от уст-в,
+        //завершение передачи журнальных данных окном
+        if ( event & EVN_ZC_DEV_UPD ) {
+            DevListUpd();
+            AckIdle();
+           }
+        //передача запросов из очереди, проверка ответов/времени ожидания ответов
+        wait = SendProc();
+       }
+ }
+#else
+//*************************************************************************************************
+// Задача управления ZigBee модулем: передача запросов из очереди msg_send и ожидание ответов
+//*************************************************************************************************
+static void TaskZBCtrl( void *pvParameters ) {
+
+    int32_t event;
+    uint8_t slot;
+    uint32_t wait = osWaitForever;
+
+    for ( ;; ) {
+        event = osEventFlagsWait( zb_ctrl, EVN_ZC_MASK, osFlagsWaitAny, wait );
+        if ( event < 0 )
+            event = 0; //вышло время ожидания ответа на запрос
+        if ( event & EVN_ZC_RECV_CHECK ) {
+            //индикация о принятии пакета
+            osEventFlagsSet( chk_event, EVN_LED_ZB_ACTIVE );
+            //передаем заполненные в прерывании ячейки пула в TaskZBFlow()
+            while ( ready_tail != ready_head ) {
+                slot = ready_ring[ready_tail & ( RECV_SLOT_CNT - 1 )];
+                ready_tail++;
+                PoolUsed();
+                //размер очереди msg_recv равен кол-ву ячеек пула, очередь не переполняется
+                osMessageQueuePut( msg_recv, &slot, 0, 0 );
+                #if ( DEBUG_POOL == 1 ) && defined( DEBUG_TARGET )
+                sprintf( str, "Slot: %u, size: %u, used: %u\r\n", slot, recv_slot[slot].len, stat_cnt[ZB_STAT_POOL_USED] );
                 UartSendStr( str );
+                #endif
                }
-            //прием завершен, чистим приемный буфер
-            ClearRecv();
            }
-        if ( event & EVN_ZC_SEND_WLOG ) {
-            //формируем подтверждение для получения следующего блока данных журнальных данных
-            data = CreatePack( ZB_PACK_ACK, data_ack.dev_numb, &data_ack.net_addr, 0, VALVE_CTRL_NOTHING, VALVE_CTRL_NOTHING, &len );
-            if ( data == NULL )
-                UartSendStr( (char *)msg_err_dev );
-            //отправка подтверждения для получения следующего блока данных
-            //тут отправляем пакет без ожидания подтверждения (TIME_NO_WAIT), в случае, если
-            //пакет сформирован неправильно, вместо запрашиваемых данных придет код ошибки
-            else ZBSendPack1( data, len, data_ack.net_addr, TIME_NO_WAIT );
+        //секундное событие: время последнего обновления данных от уст-в,
+        //завершение передачи журнальных данных окном
+        if ( event & EVN_ZC_DEV_UPD ) {
+            DevListUpd();
+            AckIdle();
            }
+        //передача запросов из очереди, проверка ответов/времени ожидания ответов
+        wait = SendProc();
        }
  }
 
@@ -353,81 +609,554 @@ static void TaskZBCtrl( void *pvParameters ) {
 //*************************************************************************************************
 static void TaskZBFlow( void *pvParameters ) {
 
-    osStatus_t status;
-    RECV_DATA recv_data;
-    uint16_t len_pack, len_chk, offset;
+    uint8_t slot;
 
     for ( ;; ) {
-        status = osMessageQueueGet( msg_recv, &recv_data, NULL, osWaitForever );
         //проверка принятых данных
-        if ( status == osOK ) {
-            //проверка системного ответа
-            chk_answ = CheckAnswer( recv_data.ptr, recv_data.len );
+        if ( osMessageQueueGet( msg_recv, &slot, NULL, osWaitForever ) == osOK )
+            RecvFrame( slot );
+       }
+ }
+#endif
+
+//*************************************************************************************************
+// Разбор принятого пакета из ячейки пула, после разбора ячейка возвращается в пул.
+// Блок данных может содержать несколько пакетов, при ошибке в данных выполняется поиск 
+// начала следующего пакета. Пакет данных завершает ожидающий его запрос (по номеру уст-ва и
+// типу пакета), для журнальных данных формируется запрос отправки подтверждения.
+//-------------------------------------------------------------------------------------------------
+// uint8_t slot - индекс ячейки пула
+//*************************************************************************************************
+static void RecvFrame( uint8_t slot ) {
+
+    uint8_t *data;
+    PACK_RESULT pack;
+    uint16_t len_pack, len_chk, offset, skip;
+
+    data = recv_slot[slot].data;
+    //проверка системного ответа
+    chk_answ = CheckAnswer( data, recv_slot[slot].len );
+    #if ( DEBUG_ZIGBEE == 1 ) && defined( DEBUG_TARGET )
+    sprintf( str, "Answer SYS: %s\r\n", AnswDesc( chk_answ ) );
+    UartSendStr( str );
+    #endif
+    if ( chk_answ == ZB_ANS_UNDEF ) {
+        offset = skip = 0;
+        len_pack = recv_slot[slot].len;
+        while ( offset < len_pack ) {
+            //полученный блок данных может содержать несколько пакетов
+            //от разных уст-в, каждый пакет разбирается отдельно
+            //пакет, проверенный при приеме, повторно КС не проверяется
+            len_chk = CheckPack1( data + offset, len_pack - offset );
+            if ( !len_chk || len_chk > len_pack - offset || 
+                 ( recv_slot[slot].checked == false && CheckPackCRC( data + offset, len_chk ) == ERROR ) ) {
+                //тип/размер/КС пакета не подтверждены: ищем начало следующего 
+                //пакета со смещением на один байт
+                if ( !skip++ && len_chk && len_chk <= len_pack - offset )
+                    ZBIncError( ZB_ERROR_CRC );
+                offset++;
+                continue;
+               }
+            if ( skip ) {
+                //найдено начало пакета после пропущенных байт
+                #if ( DEBUG_ZIGBEE == 1 ) && defined( DEBUG_TARGET )
+                sprintf( str, " Resync: offset %u, skipped %u of %u\r\n", offset, skip, len_pack );
+                UartSendStr( str );
+                #endif
+                stat_cnt[ZB_STAT_RESYNC]++;
+                stat_cnt[ZB_STAT_SKIP_BYTES] += skip;
+                skip = 0;
+               }
+            recv_cnt++; //кол-во принятых пакетов
+            //разбор полученного пакета данных, КС пакета уже проверена
+            chk_pack = CheckPack2( data + offset, len_chk, &pack );
             #if ( DEBUG_ZIGBEE == 1 ) && defined( DEBUG_TARGET )
-            sprintf( str, "Answer SYS: %s\r\n", AnswDesc( chk_answ ) );
+            sprintf( str, " Pack data: %s\r\n", PackDesc( chk_pack ) );
             UartSendStr( str );
             #endif
-            if ( chk_answ == ZB_ANS_UNDEF ) {
-                offset = 0;
-                len_pack = recv_data.len;
-                do {
-                    //полученный блок данных может содержать несколько пакетов
-                    //от разных уст-в, каждый пакет разбирается отдельно
-                    len_chk = CheckPack1( (uint8_t *)recv_data.ptr + offset );
-                    recv_cnt++; //кол-во принятых пакетов
-                    //разбор/проверка полученного пакета данных
-                    chk_pack = CheckPack2( (uint8_t *)recv_data.ptr + offset, len_chk, &data_ack );
-                    #if ( DEBUG_ZIGBEE == 1 ) && defined( DEBUG_TARGET )
-                    sprintf( str, " Pack data: %s\r\n", PackDesc( chk_pack ) );
-                    UartSendStr( str );
-                    #endif
-                    if ( chk_pack != ZB_PACK_UNDEF ) {
-                        //пакет данных - текущее состояние контроллера
-                        if ( chk_pack == ZB_PACK_STATE ) {
-                            OutData( ZB_PACK_STATE );
-                            //osEventFlagsSet( cmnd_event, EVN_CMND_PROMPT );
-                           }
-                        //пакет данных - текущие данные расхода/давления/утечки воды
-                        if ( chk_pack == ZB_PACK_DATA ) {
-                            OutData( ZB_PACK_DATA ); 
-                            //osEventFlagsSet( cmnd_event, EVN_CMND_PROMPT );
-                           }
-                        //пакет данных - состояние электроприводов
-                        if ( chk_pack == ZB_PACK_VALVE ) {
-                            OutData( ZB_PACK_VALVE ); 
-                            //osEventFlagsSet( cmnd_event, EVN_CMND_PROMPT );
-                           }
-                        //пакет данных - состояние датчиков утечки
-                        if ( chk_pack == ZB_PACK_LEAKS ) {
-                            OutData( ZB_PACK_LEAKS ); 
-                            //osEventFlagsSet( cmnd_event, EVN_CMND_PROMPT );
-                           }
-                        //пакет данных - журнальные данные расхода/давления/утечки воды
-                        if ( chk_pack == ZB_PACK_WLOG ) {
-                            OutData( ZB_PACK_WLOG );
-                            osEventFlagsSet( zb_ctrl, EVN_ZC_SEND_WLOG );
-                           }
-                       }
-                    //смещение на следующий пакет данных
-                    offset += len_chk;
-                    //остаток для проверки
-                    len_pack -= len_chk;
-                  } while ( len_pack && len_chk );
+            if ( chk_pack != ZB_PACK_UNDEF ) {
+                //вывод данных пакета, данные читаются из ячейки пула до ее освобождения
+                OutData( &pack );
+                //завершение запроса, ожидающего этот пакет от уст-ва
+                SendMatch( chk_pack, pack.dev_numb, ZB_ERROR_OK );
+                //пакет данных требует подтверждения (журнальные данные расхода/давления/утечки воды)
+                if ( pack.ack == true )
+                    SendAck( &pack );
                }
-            //проверка принятого пакета завершена, освободим блок памяти
-            if ( recv_data.ptr != NULL )
-                vPortFree( recv_data.ptr );
-            #if ( DEBUG_MALLOC == 1 ) && defined( DEBUG_TARGET )
-            sprintf( str, "Memory free: %u, available: %u\r\n", recv_data.len, xPortGetFreeHeapSize() ); 
+            //смещение на следующий пакет данных
+            offset += len_chk;
+           }
+        //пропущенные байты в конце блока
+        #if ( DEBUG_ZIGBEE == 1 ) && defined( DEBUG_TARGET )
+        if ( skip ) {
+            sprintf( str, " Resync: %u bytes skipped at end of %u\r\n", skip, len_pack );
             UartSendStr( str );
-            #endif
-            //проверка ожидания ответа
-            if ( time_out == true ) {
-                time_out = false;
-                //снимаем семафор для последующей обработки ответа
-                osSemaphoreRelease( sem_ans );
+           }
+        #endif
+        stat_cnt[ZB_STAT_SKIP_BYTES] += skip;
+       }
+    //проверка принятого пакета завершена, вернем ячейку в пул
+    osMessageQueuePut( msg_free, &slot, 0, 0 );
+    //модуль отклонил команду: завершаем запрос, если передан только он, иначе запросы
+    //пакетной передачи завершаются по времени ожидания ответа/повторной передачей
+    if ( chk_answ == ZB_ANS_ERROR ) {
+        if ( send_last != SEND_REQ_NONE )
+            SendMatch( ZB_PACK_UNDEF, 0, ZB_ERROR_EXEC );
+        else stat_cnt[ZB_STAT_ERR_UNMATCHED]++;
+       }
+    //ответ модуля на команду управления
+    if ( chk_answ != ZB_ANS_UNDEF && chk_answ != ZB_ANS_ERROR )
+        SendMatchSys( chk_answ );
+    //проверка ожидания ответа
+    if ( time_out == true ) {
+        time_out = false;
+        //снимаем семафор для последующей обработки ответа
+        osSemaphoreRelease( sem_ans );
+       }
+ }
+
+//*************************************************************************************************
+// Отправка подтверждения получения журнальных данных для получения следующего блока данных.
+// Подтверждение передается через очередь запросов, номер и адрес уст-ва берутся из 
+// принятого пакета, поэтому подтверждения разным уст-вам не перезаписывают друг друга.
+// Если свободной ячейки пула запросов нет, подтверждение откладывается в ack_wait[] и 
+// повторно ставится в очередь из SendProc() после освобождения ячеек.
+//-------------------------------------------------------------------------------------------------
+// PACK_RESULT *pack - результат разбора принятого пакета
+//*************************************************************************************************
+static void SendAck( PACK_RESULT *pack ) {
+
+    //при передаче окном подтверждаются все записи по номер pack->seq включительно
+    if ( pack->type_pack == ZB_PACK_WLOG_SEQ )
+        AckQueue( ZB_PACK_ACK_WIN, pack->dev_numb, pack->seq );
+    else AckQueue( ZB_PACK_ACK, pack->dev_numb, 0 );
+ }
+
+//*************************************************************************************************
+// Постановка подтверждения в очередь запросов или в отложенные подтверждения ack_wait[]
+//-------------------------------------------------------------------------------------------------
+// ZBTypePack type     - тип подтверждения: ZB_PACK_ACK/ZB_PACK_ACK_WIN
+// uint16_t dev_numb   - номер уст-ва
+// uint8_t seq         - номер подтверждаемой записи (ZB_PACK_ACK_WIN)
+//*************************************************************************************************
+static void AckQueue( ZBTypePack type, uint16_t dev_numb, uint8_t seq ) {
+
+    uint8_t ind;
+    ACK_WAIT *ack, *empty = NULL;
+
+    if ( AckPost( type, dev_numb, seq ) != ZB_ERROR_BUSY )
+        return;
+    //откладываем подтверждение, более новое подтверждение уст-ву заменяет отложенное
+    osKernelLock();
+    for ( ind = 0; ind < ACK_WAIT_CNT; ind++ ) {
+        ack = &ack_wait[ind];
+        if ( ack->type != ZB_PACK_UNDEF && ack->dev_numb == dev_numb )
+            break;
+        if ( ack->type == ZB_PACK_UNDEF && empty == NULL )
+            empty = ack;
+       }
+    if ( ind == ACK_WAIT_CNT )
+        ack = empty;
+    if ( ack != NULL ) {
+        ack->type = type;
+        ack->dev_numb = dev_numb;
+        ack->seq = seq;
+        stat_cnt[ZB_STAT_ACK_DEFER]++;
+       }
+    else stat_cnt[ZB_STAT_ACK_DROP]++;
+    osKernelUnlock();
+ }
+
+//*************************************************************************************************
+// Финальное подтверждение передачи журнальных данных окном, записи которой больше не 
+// поступают (см. WLogEnd()), вызывается из TaskZBCtrl() по секундному событию
+//*************************************************************************************************
+static void AckIdle( void ) {
+
+    uint8_t seq;
+    uint16_t dev_numb;
+
+    while ( WLogEnd( &dev_numb, &seq ) == true )
+        AckQueue( ZB_PACK_ACK_WIN, dev_numb, seq );
+ }
+
+//*************************************************************************************************
+// Постановка подтверждения в очередь запросов на передачу
+//-------------------------------------------------------------------------------------------------
+// ZBTypePack type     - тип подтверждения: ZB_PACK_ACK/ZB_PACK_ACK_WIN
+// uint16_t dev_numb   - номер уст-ва
+// uint8_t seq         - номер подтверждаемой записи (ZB_PACK_ACK_WIN)
+// return ZBErrorState - результат добавления запроса в очередь
+//*************************************************************************************************
+static ZBErrorState AckPost( ZBTypePack type, uint16_t dev_numb, uint8_t seq ) {
+
+    ZBErrorState state;
+
+    //формируем подтверждение для получения следующего блока данных журнальных данных
+    //и отправляем пакет без ожидания подтверждения (TIME_NO_WAIT), в случае, если
+    //пакет сформирован неправильно, вместо запрашиваемых данных придет код ошибки
+    state = ZBSendCreate( type, dev_numb, seq, VALVE_CTRL_NOTHING, VALVE_CTRL_NOTHING, TIME_NO_WAIT, NULL, NULL );
+    if ( state == ZB_ERROR_NUMB )
+        UartSendStr( (char *)msg_err_dev );
+    return state;
+ }
+
+//*************************************************************************************************
+// Повторная постановка отложенных подтверждений в очередь запросов, вызывается из SendProc()
+//-------------------------------------------------------------------------------------------------
+// return = true - остались отложенные подтверждения (нет свободной ячейки пула запросов)
+//*************************************************************************************************
+static bool AckRetry( void ) {
+
+    uint8_t ind;
+    ACK_WAIT ack;
+
+    for ( ind = 0; ind < ACK_WAIT_CNT; ind++ ) {
+        if ( ack_wait[ind].type == ZB_PACK_UNDEF )
+            continue;
+        osKernelLock();
+        ack = ack_wait[ind];
+        osKernelUnlock();
+        if ( AckPost( ack.type, ack.dev_numb, ack.seq ) == ZB_ERROR_BUSY )
+            return true;
+        //ячейка освобождается, если за время повтора не заменена более новым подтверждением
+        osKernelLock();
+        if ( ack_wait[ind].type == ack.type && ack_wait[ind].dev_numb == ack.dev_numb && ack_wait[ind].seq == ack.seq )
+            ack_wait[ind].type = ZB_PACK_UNDEF;
+        osKernelUnlock();
+       }
+    return false;
+ }
+
+//*************************************************************************************************
+// Выполнение запросов на передачу из очереди msg_send, вызывается только из TaskZBCtrl().
+// Переданные запросы, ожидающие ответ, хранятся в пуле запросов (таблица ожидания ответов) 
+// с собственным временем окончания ожидания, поэтому запросы разным уст-вам выполняются 
+// одновременно. Запрос с тем же ключом (номер уст-ва, тип ответа), что и у ожидающего ответ 
+// запроса, остается в очереди до завершения предыдущего. Все готовые к передаче запросы 
+// передаются одной пакетной передачей (см. SendChain()), блокировка модуля zb_mutex 
+// устанавливается только на время передачи. Ответ модуля об ошибке команды (ZB_ANS_ERROR) не 
+// указывает, к какому пакету он относится, а при успешной передаче модуль не отвечает, поэтому
+// ответ об ошибке сопоставляется с запросом только при передаче одного пакета (send_last). 
+// Команды управления модулем передаются только по одной, без других пакетов.
+//-------------------------------------------------------------------------------------------------
+// return - время до следующего вызова (ожидание ответа/повтор захвата модуля), 
+//          osWaitForever - нет запросов, ожидающих ответ или передачу
+//*************************************************************************************************
+static uint32_t SendProc( void ) {
+
+    int32_t time;
+    uint8_t ind, cnt, pos, sent;
+    uint32_t wait = osWaitForever;
+    SEND_REQ *req;
+    ZBSendClass cls;
+    ZBErrorState state;
+    bool single = false;
+
+    //проверка запросов, ожидающих ответ: ответ получен/вышло время ожидания
+    for ( ind = 0; ind < SEND_REQ_CNT; ind++ ) {
+        req = &send_req[ind];
+        if ( req->pend == false || req->queued == true )
+            continue;
+        if ( req->done == true ) {
+            if ( req->state == ZB_ERROR_OK ) {
+                //время ответа учитывается только для запроса, переданного один раз (правило Карна)
+                if ( req->tries == 1 && (int32_t)( req->time_recv - req->time_send ) >= 0 )
+                    DevRttUpd( req->dev_numb, req->time_recv - req->time_send );
+                if ( req->tries > 1 )
+                    stat_cnt[ZB_STAT_RETRY_OK]++;
+                DevRetryGive( req->dev_numb );
+               }
+            SendDone( ind, req->state );
+            continue;
+           }
+        time = (int32_t)( req->deadline - osKernelGetTickCount() );
+        if ( time <= 0 && req->retry == true ) {
+            //задержка повтора истекла, запрос повторно в очередь передачи
+            req->retry = false;
+            req->queued = true;
+            osMessageQueuePut( msg_send[req->cls], &ind, 0, 0 );
+            continue;
+           }
+        if ( time <= 0 ) {
+            DevRtoBackoff( req->dev_numb );
+            time = SendRetry( req );
+            if ( !time ) {
+                SendDone( ind, ZB_ERROR_TIMEOUT );
+                continue;
+               }
+           }
+        if ( (uint32_t)time < wait )
+            wait = time;
+       }
+    //отложенные подтверждения: повтор через TIME_SEND_RETRY до освобождения ячеек пула
+    if ( AckRetry() == true && wait > TIME_SEND_RETRY )
+        wait = TIME_SEND_RETRY;
+    for ( cnt = 0, cls = ZB_CLASS_CTRL; cls < ZB_CLASS_CNT; cls++ )
+        cnt += osMessageQueueGetCount( msg_send[cls] );
+    if ( !cnt )
+        return wait;
+    //модуль занят другой задачей, повтор передачи через TIME_SEND_RETRY
+    if ( osMutexAcquire( zb_mutex, 0 ) != osOK )
+        return wait < TIME_SEND_RETRY ? wait : TIME_SEND_RETRY;
+    //формируем очередь пакетной передачи: строгий приоритет, сначала все запросы 
+    //класса ZB_CLASS_CTRL, затем ZB_CLASS_QUERY, затем ZB_CLASS_BULK
+    state = SendReady();
+    tx_cnt = 0;
+    for ( cls = ZB_CLASS_CTRL; cls < ZB_CLASS_CNT; cls++ ) {
+        cnt = osMessageQueueGetCount( msg_send[cls] );
+        while ( cnt-- ) {
+            osMessageQueueGet( msg_send[cls], &ind, NULL, 0 );
+            req = &send_req[ind];
+            req->queued = false;
+            if ( req->done == true ) {
+                //ответ получен во время ожидания повтора, запрос завершается при следующем вызове
+                wait = 0;
+                continue;
+               }
+            if ( SendBusy( req ) == true ) {
+                //от уст-ва ожидается ответ того же типа, запрос остается в очереди
+                osMessageQueuePut( msg_send[cls], &ind, 0, 0 );
+                continue;
+               }
+            if ( single == true || ( req->sys != ZB_ANS_UNDEF && tx_cnt ) ) {
+                //команда управления модулем передается отдельно, остальные запросы
+                //передаются следующей пакетной передачей
+                osMessageQueuePut( msg_send[cls], &ind, 0, 0 );
+                wait = 0;
+                continue;
                }
+            if ( state == ZB_ERROR_RUN || ( state != ZB_ERROR_OK && req->sys == ZB_ANS_UNDEF ) ) {
+                //модуль не включен или нет сети (кроме команд управления) - запрос завершен
+                SendDone( ind, state );
+                continue;
+               }
+            //ограничение скорости передачи класса запроса (кроме команд управления модулем и 
+            //подтверждений), при превышении запрос остается в очереди до пополнения ограничителя
+            time = ( req->sys == ZB_ANS_UNDEF && SendIsAck( req ) == false ) ? RateTake( cls, req->len ) : 0;
+            if ( time ) {
+                stat_cnt[ZB_STAT_RATE_DEFER]++;
+                osMessageQueuePut( msg_send[cls], &ind, 0, 0 );
+                if ( (uint32_t)time < wait )
+                    wait = time;
+                continue;
+               }
+            if ( req->time_answ && ( req->answ != ZB_PACK_UNDEF || req->sys != ZB_ANS_UNDEF ) ) {
+                //ключ запроса занят с момента постановки в очередь передачи
+                req->done = false;
+                req->pend = true;
+               }
+            if ( !req->tries++ ) {
+                //статистика: время ожидания первой передачи по классу запроса
+                time = osKernelGetTickCount() - req->time_post;
+                stat_cnt[ZB_STAT_CTRL_SENT + cls]++;
+                stat_cnt[ZB_STAT_CTRL_WAIT_SUM + cls] += time;
+                if ( (uint32_t)time > stat_cnt[ZB_STAT_CTRL_WAIT_MAX + cls] )
+                    stat_cnt[ZB_STAT_CTRL_WAIT_MAX + cls] = time;
+               }
+            tx_ring[tx_cnt++] = ind;
+            if ( req->sys != ZB_ANS_UNDEF )
+                single = true;
+           }
+       }
+    if ( !tx_cnt ) {
+        osMutexRelease( zb_mutex );
+        return wait;
+       }
+    cnt = tx_cnt;
+    sent = SendChain();
+    //передача завершена, снимаем блокировку доступа к ZigBee модулю
+    osMutexRelease( zb_mutex );
+    //ответ модуля об ошибке относится к запросу, только если передан один пакет
+    send_last = ( cnt == 1 && sent == 1 ) ? tx_ring[0] : SEND_REQ_NONE;
+    for ( pos = 0; pos < cnt; pos++ ) {
+        ind = tx_ring[pos];
+        req = &send_req[ind];
+        //запрос передачи журнальных данных окном передан: начало контроля окна уст-ва
+        if ( pos < sent && req->frame[SEND_FRAME_HEAD] == ZB_PACK_REQ_WLOG )
+            WLogStart( req->frame + SEND_FRAME_HEAD );
+        if ( pos >= sent || req->pend == false ) {
+            //ошибка передачи или ответ не ожидается - запрос завершен
+            SendDone( ind, pos < sent ? ZB_ERROR_OK : ZB_ERROR_SEND );
+            continue;
+           }
+        //ожидаем ответ, время ожидания по оценке времени ответа уст-ва или заданное
+        time = req->time_answ == TIME_WAIT_RTO ? DevRto( req->dev_numb ) : req->time_answ;
+        req->time_send = osKernelGetTickCount();
+        req->deadline = req->time_send + time;
+        if ( (uint32_t)time < wait )
+            wait = time;
+       }
+    return wait;
+ }
+
+//*************************************************************************************************
+// Проверка наличия в таблице ожидания ответов запроса с тем же ключом: номер уст-ва, тип ответа
+//-------------------------------------------------------------------------------------------------
+// SEND_REQ *req - проверяемый запрос
+// return = true - ответ на запрос с тем же ключом еще ожидается
+//*************************************************************************************************
+static bool SendBusy( SEND_REQ *req ) {
+
+    uint8_t ind;
+
+    if ( req->sys != ZB_ANS_UNDEF ) {
+        //команды управления модулем выполняются по одной
+        for ( ind = 0; ind < SEND_REQ_CNT; ind++ ) {
+            if ( &send_req[ind] != req && send_req[ind].pend == true && send_req[ind].sys != ZB_ANS_UNDEF )
+                return true;
            }
+        return false;
+       }
+    if ( req->answ == ZB_PACK_UNDEF )
+        return false;
+    for ( ind = 0; ind < SEND_REQ_CNT; ind++ ) {
+        if ( &send_req[ind] == req )
+            continue; //повторная передача запроса, ключ занят самим запросом
+        if ( send_req[ind].pend == true && send_req[ind].answ == req->answ && send_req[ind].dev_numb == req->dev_numb )
+            return true;
+       }
+    return false;
+ }
+
+//*************************************************************************************************
+// Планирование повторной передачи запроса, на который не получен ответ. Задержка повтора
+// увеличивается в 2 раза при каждом повторе (TIME_RETRY_BASE ... TIME_RETRY_MAX) со 
+// случайной добавкой (0 ... задержка/2), что исключает одновременные повторы запросов 
+// разным уст-вам. Повтор выполняется при наличии лимита повторов уст-ва и если общий 
+// объем повторных передач за RETRY_AIR_WINDOW не превышает RETRY_AIR_BYTES.
+//-------------------------------------------------------------------------------------------------
+// SEND_REQ *req - запрос
+// return = 0    - повтор не выполняется, запрос завершен с ошибкой
+//        > 0    - задержка до повторной передачи (msec)
+//*************************************************************************************************
+static int32_t SendRetry( SEND_REQ *req ) {
+
+    uint32_t delay, tick;
+
+    //команды управления модулем не повторяются
+    if ( req->sys != ZB_ANS_UNDEF || req->tries > SEND_RETRY_MAX )
+        return 0;
+    //ограничение эфирного времени повторных передач
+    tick = osKernelGetTickCount();
+    if ( tick - retry_air_start >= RETRY_AIR_WINDOW ) {
+        retry_air_start = tick;
+        retry_air_bytes = 0;
+       }
+    if ( retry_air_bytes + req->size > RETRY_AIR_BYTES ) {
+        stat_cnt[ZB_STAT_RETRY_AIR]++;
+        return 0;
+       }
+    //лимит повторных передач уст-ву
+    if ( DevRetryTake( req->dev_numb ) == false ) {
+        stat_cnt[ZB_STAT_RETRY_BUDGET]++;
+        return 0;
+       }
+    retry_air_bytes += req->size;
+    stat_cnt[ZB_STAT_RETRY]++;
+    //задержка повтора: экспоненциальная + случайная добавка (xorshift32)
+    delay = TIME_RETRY_BASE << ( req->tries - 1 );
+    if ( delay > TIME_RETRY_MAX )
+        delay = TIME_RETRY_MAX;
+    if ( !retry_seed )
+        retry_seed = tick | 1;
+    retry_seed ^= retry_seed << 13;
+    retry_seed ^= retry_seed >> 17;
+    retry_seed ^= retry_seed << 5;
+    delay += retry_seed % ( delay / 2 + 1 );
+    req->deadline = tick + delay;
+    req->retry = true;
+    return delay;
+ }
+
+//*************************************************************************************************
+// Сопоставление принятого пакета с ожидающим ответ запросом. Вызывается из RecvFrame(), 
+// запрос завершается в задаче TaskZBCtrl() по событию EVN_ZC_SEND_ANSW.
+//-------------------------------------------------------------------------------------------------
+// ZBTypePack answ    - тип принятого пакета, ZB_PACK_UNDEF - единственный запрос последней
+//                      пакетной передачи (send_last)
+// uint16_t dev_numb  - номер уст-ва, от которого принят пакет
+// ZBErrorState state - результат выполнения запроса
+//*************************************************************************************************
+static void SendMatch( ZBTypePack answ, uint16_t dev_numb, ZBErrorState state ) {
+
+    uint8_t ind;
+    SEND_REQ *req;
+
+    for ( ind = 0; ind < SEND_REQ_CNT; ind++ ) {
+        req = &send_req[ind];
+        if ( req->pend == false || req->done == true )
+            continue;
+        if ( answ == ZB_PACK_UNDEF ? ind != send_last : ( req->answ != answ || req->dev_numb != dev_numb ) )
+            continue;
+        req->state = state;
+        req->time_recv = osKernelGetTickCount();
+        req->done = true;
+        osEventFlagsSet( zb_ctrl, EVN_ZC_SEND_ANSW );
+        return;
+       }
+ }
+
+//*************************************************************************************************
+// Сопоставление ответа модуля с ожидающей ответ командой управления модулем. Вызывается 
+// из RecvFrame(), запрос завершается в задаче TaskZBCtrl() по событию EVN_ZC_SEND_ANSW.
+//-------------------------------------------------------------------------------------------------
+// ZBAnswer answ - ответ модуля
+//*************************************************************************************************
+static void SendMatchSys( ZBAnswer answ ) {
+
+    uint8_t ind;
+    SEND_REQ *req;
+
+    for ( ind = 0; ind < SEND_REQ_CNT; ind++ ) {
+        req = &send_req[ind];
+        if ( req->pend == false || req->done == true || req->sys != answ )
+            continue;
+        req->state = ZB_ERROR_OK;
+        req->time_recv = osKernelGetTickCount();
+        req->done = true;
+        osEventFlagsSet( zb_ctrl, EVN_ZC_SEND_ANSW );
+        return;
+       }
+ }
+
+//*************************************************************************************************
+// Завершение запроса: вызов функции завершения запроса, возврат ячейки запроса в пул
+//-------------------------------------------------------------------------------------------------
+// uint8_t ind        - индекс ячейки пула запросов
+// ZBErrorState state - результат выполнения запроса
+//*************************************************************************************************
+static void SendDone( uint8_t ind, ZBErrorState state ) {
+
+    uint8_t next;
+    SEND_REQ *req;
+
+    req = &send_req[ind];
+    req->pend = false;
+    req->done = false;
+    req->retry = false;
+    if ( send_last == ind )
+        send_last = SEND_REQ_NONE;
+    //отсоединяем присоединенные запросы, новые запросы больше не присоединяются
+    osKernelLock();
+    req->used = false;
+    next = req->next;
+    req->next = SEND_REQ_NONE;
+    osKernelUnlock();
+    ZBIncError( state );
+    if ( req->callback != NULL )
+        req->callback( state, req->arg );
+    osMessageQueuePut( msg_send_free, &ind, 0, 0 );
+    //завершение присоединенных запросов с тем же результатом
+    while ( next != SEND_REQ_NONE ) {
+        ind = next;
+        req = &send_req[ind];
+        next = req->next;
+        req->next = SEND_REQ_NONE;
+        req->follow = false;
+        if ( req->callback != NULL )
+            req->callback( state, req->arg );
+        osMessageQueuePut( msg_send_free, &ind, 0, 0 );
        }
  }
 
@@ -439,6 +1168,14 @@ static void Timer1Callback( void *arg ) {
     osEventFlagsSet( zb_init, EVN_ZB_CONFIG );
  }
 
+//*************************************************************************************************
+// CallBack функция таймера, завершение сигнала аппаратного сброса ZigBee модуля
+//*************************************************************************************************
+static void Timer2Callback( void *arg ) {
+
+    HAL_GPIO_WritePin( ZB_RES_GPIO_Port, ZB_RES_Pin, GPIO_PIN_SET );
+ }
+
 //*************************************************************************************************
 // CallBack функция TIMER6 - пауза в приеме данных, прием пакета завершен
 //*************************************************************************************************
@@ -446,10 +1183,19 @@ void ZBCallBack( void ) {
 
     //выключаем таймер
     __HAL_TIM_DISABLE( &htim6 );
-    //сообщим в задачу для дальнейшей обработки принятых данных
-    if ( recv_ind ) {
-        osEventFlagsSet( zb_ctrl, EVN_ZC_RECV_CHECK );
-       }
+    //передаем принятый пакет для дальнейшей обработки
+    RecvClose();
+ }
+
+//*************************************************************************************************
+// Секундное событие, вызывается из прерывания RTC. Список уст-в и кэш данных уст-в 
+// обновляются в TaskZBCtrl(), т.к. кэш читается/записывается задачами с блокировкой 
+// osKernelLock(), которая не запрещает прерывания.
+//*************************************************************************************************
+void ZBTimeTick( void ) {
+
+    if ( zb_ctrl != NULL )
+        osEventFlagsSet( zb_ctrl, EVN_ZC_DEV_UPD );
  }
 
 //*************************************************************************************************
@@ -458,11 +1204,14 @@ void ZBCallBack( void ) {
 void ZBRecvComplt( void ) {
 
     //прием одного байта
-    if ( recv_ind < sizeof( recv_buff ) )
-        recv_buff[recv_ind++] = recv;
-    else ClearRecv(); //переполнение буфера
+    RecvCopy( &recv, sizeof( recv ) );
     //продолжаем прием
     HAL_UART_Receive_IT( &huart3, (uint8_t *)&recv, sizeof( recv ) );
+    //пакет завершен по размеру - контроль паузы не нужен
+    if ( !recv_ind ) {
+        __HAL_TIM_DISABLE( &htim6 );
+        return;
+       }
     //если таймер выключен - стартуем один раз
     //при приеме каждого следующего байта - только сброс счетчика
     if ( !( htim6.Instance->CR1 & TIM_CR1_CEN ) )
@@ -470,53 +1219,159 @@ void ZBRecvComplt( void ) {
     else __HAL_TIM_SetCounter( &htim6, 0 );
 }
 
+//*************************************************************************************************
+// CallBack функция приема данных по DMA (циклический буфер), вызывается при обнаружении паузы 
+// на линии (IDLE), а также при заполнении половины/всего буфера dma_buff[]
+// Новые данные в циклическом буфере находятся между dma_pos и size, данные переносятся 
+// в текущую ячейку пула, по паузе на линии прием пакета считается завершенным
+//-------------------------------------------------------------------------------------------------
+// uint16_t size - текущая позиция записи DMA в буфере dma_buff[]
+//*************************************************************************************************
+void ZBRecvEvent( uint16_t size ) {
+
+    #if RECV_MODE_DMA == 1
+    if ( size != dma_pos ) {
+        if ( size > dma_pos )
+            RecvCopy( dma_buff + dma_pos, size - dma_pos );
+        else {
+            //запись DMA перешла через начало буфера
+            RecvCopy( dma_buff + dma_pos, sizeof( dma_buff ) - dma_pos );
+            RecvCopy( dma_buff, size );
+           }
+        dma_pos = ( size < sizeof( dma_buff ) ) ? size : 0;
+       }
+    //пауза в приеме данных, прием пакета завершен
+    if ( HAL_UARTEx_GetRxEventType( &huart3 ) == HAL_UART_RXEVENT_IDLE )
+        RecvClose();
+    #endif
+ }
+
+//*************************************************************************************************
+// CallBack функция ошибки приема по UART3, HAL при ошибке (переполнение, ошибка кадра) 
+// прекращает прием, поэтому выполняем перезапуск приема. Частично принятый пакет отбрасывается,
+// ячейка пула (если была занята) используется для приема следующего пакета
+//*************************************************************************************************
+void ZBRecvError( void ) {
+
+    stat_cnt[ZB_STAT_UART_ERROR]++;
+    if ( recv_ind || recv_skip == true )
+        stat_cnt[ZB_STAT_FRAME_DROP]++;
+    recv_size = 0;
+    recv_skip = false;
+    recv_ind = 0;
+    StartRecv();
+ }
+
 //*************************************************************************************************
 // CallBack функция, вызывается при завершении передачи из UART2
 //*************************************************************************************************
 void ZBSendComplt( void ) {
 
+    SEND_REQ *req;
+
+    if ( tx_cnt ) {
+        //пакетная передача: сразу запускаем передачу следующего пакета из очереди
+        tx_done++;
+        if ( tx_done < tx_cnt ) {
+            req = &send_req[tx_ring[tx_done]];
+            if ( HAL_UART_Transmit_DMA( &huart3, req->frame, req->size ) == HAL_OK )
+                return;
+           }
+       }
     osSemaphoreRelease( sem_send );
  }
 
 //*************************************************************************************************
 // Управление ZigBee модулем, кроме команды ZB_SEND_DATA, данные передаются через ZBSendPack()
+// Команда выполняется через очередь запросов ZBControlAsync(), вызывающая задача блокируется
+// до получения ответа модуля, прием и передача пакетов уст-вам при этом не блокируются.
+// Вызов из задачи обмена с модулем (функции завершения запроса) не допускается.
 //-------------------------------------------------------------------------------------------------
 // ZBCmnd command      - код команды
 // return ZBErrorState - результат выполнения
 //*************************************************************************************************
 ZBErrorState ZBControl( ZBCmnd command ) {
 
-    uint8_t ind;
+    SEND_SYNC sync;
     ZBErrorState state;
+
+    sync.thread = osThreadGetId();
+    sync.state = ZB_ERROR_UNDEF;
+    //задача обмена с модулем не может ожидать выполнения собственного запроса
+    if ( sync.thread == zb_task ) {
+        ZBIncError( ZB_ERROR_BUSY );
+        return ZB_ERROR_BUSY;
+       }
+    state = ZBControlAsync( command, SendSync, &sync );
+    if ( state != ZB_ERROR_OK )
+        return state;
+    osThreadFlagsWait( FLAG_SEND_SYNC, osFlagsWaitAny, osWaitForever );
+    return sync.state;
+ }
+
+//*************************************************************************************************
+// Асинхронное выполнение команды управления ZigBee модулем. Команда формируется в ячейке 
+// пула запросов и передается задачей TaskZBCtrl() в классе ZB_CLASS_CTRL, ответ модуля 
+// сопоставляется с ожидаемым ответом из описания команды zb_cmd[].
+// Аппаратный сброс (ZB_CMD_DEV_RESET) выполняется сразу: сигнал сброса снимается по таймеру
+// через TIME_DELAY_RESET без блокировки модуля, функция завершения вызывается из ZBControlAsync().
+//-------------------------------------------------------------------------------------------------
+// ZBCmnd command          - код команды
+// ZBSendCallBack callback - функция завершения запроса (может быть NULL)
+// void *arg               - параметр функции завершения запроса
+// return ZBErrorState     - ZB_ERROR_OK - запрос добавлен в очередь, иначе ошибка 
+//                           (функция завершения запроса не вызывается)
+//*************************************************************************************************
+ZBErrorState ZBControlAsync( ZBCmnd command, ZBSendCallBack callback, void *arg ) {
+
+    uint8_t ind, cmd;
+    SEND_REQ *req;
     
     //проверка включенного ZigBee модуля
     if ( DevStatus( ZB_STATUS_RUN ) == ERROR )
         return ZB_ERROR_RUN;
-    //блокировка доступа к ZigBee модулю
-    osMutexAcquire( zb_mutex, osWaitForever );
     if ( command == ZB_CMD_DEV_RESET ) {
-        //формируем сигнал сброса ZigBee модуля
+        //формируем сигнал сброса ZigBee модуля на TIME_DELAY_RESET msec
         HAL_GPIO_WritePin( ZB_RES_GPIO_Port, ZB_RES_Pin, GPIO_PIN_RESET );
-        //удержание сигнала сброса на TIME_DELAY_RESET msec
-        osDelay( TIME_DELAY_RESET );
-        HAL_GPIO_WritePin( ZB_RES_GPIO_Port, ZB_RES_Pin, GPIO_PIN_SET );
-        //снимаем блокировку доступа к ZigBee модулю
-        osMutexRelease( zb_mutex );
+        osTimerStart( timer_reset, TIME_DELAY_RESET );
+        if ( callback != NULL )
+            callback( ZB_ERROR_OK, arg );
         return ZB_ERROR_OK;
        }
-    //проверка и выполнение команды
-    for ( ind = 0; ind < SIZE_ARRAY( zb_cmd ); ind++ ) {
-        if ( zb_cmd[ind].id_command != command )
-            continue;
-        //выполнение команды через вызов функций: Command(), SetCfg()
-        state = zb_cmd[ind].func_exec( &zb_cmd[ind] );
-        break;
+    //поиск команды
+    for ( cmd = 0; cmd < SIZE_ARRAY( zb_cmd ); cmd++ ) {
+        if ( zb_cmd[cmd].id_command == command )
+            break;
        }
-    //снимаем блокировку доступа к ZigBee модулю
-    osMutexRelease( zb_mutex );
-    if ( ind == SIZE_ARRAY( zb_cmd ) )
+    if ( cmd == SIZE_ARRAY( zb_cmd ) )
         return ZB_ERROR_CMD;
-    return state;
+    //свободная ячейка пула запросов
+    if ( osMessageQueueGet( msg_send_free, &ind, NULL, 0 ) != osOK ) {
+        ZBIncError( ZB_ERROR_BUSY );
+        return ZB_ERROR_BUSY;
+       }
+    req = &send_req[ind];
+    //формирование команды в ячейке через вызов функций: Command(), SetCfg()
+    req->size = zb_cmd[cmd].func_exec( &zb_cmd[cmd], req->frame );
+    req->len = req->size;
+    req->sys = zb_cmd[cmd].id_answer;
+    req->addr = 0;
+    req->dev_numb = 0;
+    req->answ = ZB_PACK_UNDEF;
+    req->time_answ = zb_cmd[cmd].time_answer;
+    req->tries = 0;
+    req->retry = false;
+    req->queued = false;
+    req->callback = callback;
+    req->arg = arg;
+    req->cls = ZB_CLASS_CTRL;
+    req->time_post = osKernelGetTickCount();
+    req->follow = false;
+    req->next = SEND_REQ_NONE;
+    req->used = true;
+    osMessageQueuePut( msg_send[req->cls], &ind, 0, 0 );
+    osEventFlagsSet( zb_ctrl, EVN_ZC_SEND_REQ );
+    return ZB_ERROR_OK;
  }
 
 //*************************************************************************************************
@@ -524,35 +1379,31 @@ ZBErrorState ZBControl( ZBCmnd command ) {
 // чтение параметров ) вызывается по ссылке
 //-------------------------------------------------------------------------------------------------
 // uint8_t *ptr        - указатель на ZB_COMMAND
-// return ZBErrorState - результат выполнения
+// uint8_t *data       - указатель на буфер для размещения команды
+// return              - размер команды
 //*************************************************************************************************
-static ZBErrorState Command( void *ptr ) {
+static uint8_t Command( void *ptr, uint8_t *data ) {
 
     ZB_COMMAND *zc_ptr;
-    ZBErrorState state;
 
     zc_ptr = (ZB_COMMAND *)ptr;
-    memset( buff_data, 0x00, sizeof( buff_data ) );
-    memcpy( buff_data, zc_ptr->code_command, sizeof( zc_ptr->code_command ) );
-    //передача данных
-    state = SendData( zc_ptr->id_command, buff_data, sizeof( zc_ptr->code_command ), zc_ptr->time_answer );
-    ZBIncError( state );
-    return state;
+    memcpy( data, zc_ptr->code_command, sizeof( zc_ptr->code_command ) );
+    return sizeof( zc_ptr->code_command );
  }
 
 //*************************************************************************************************
 // Формирует команды записи параметров ZigBee модуля
 //-------------------------------------------------------------------------------------------------
 // uint8_t *ptr        - указатель на ZB_COMMAND
-// return ZBErrorState - результат выполнения
+// uint8_t *data       - указатель на буфер для размещения команды
+// return              - размер команды
 //*************************************************************************************************
-static ZBErrorState SetCfg( void *ptr ) {
+static uint8_t SetCfg( void *ptr, uint8_t *data ) {
 
     uint8_t *dst, *cfg_ptr;
     ZB_COMMAND *zc_ptr;
-    ZBErrorState state;
     
-    dst = buff_data;
+    dst = data;
     zc_ptr = (ZB_COMMAND *)ptr;
     //установка параметров, тип уст-ва
     zb_cfg.dev_type = ZB_DEV_COORDINATOR;          
@@ -572,8 +1423,7 @@ static ZBErrorState SetCfg( void *ptr ) {
     //ключ шифрования
     memcpy( (uint8_t *)&zb_cfg.key, config.net_key, sizeof( zb_cfg.key ) );
     //копируем всю команду
-    memset( buff_data, 0x00, sizeof( buff_data ) );
-    memcpy( buff_data, zc_ptr->code_command, sizeof( zc_ptr->code_command ) );
+    memcpy( data, zc_ptr->code_command, sizeof( zc_ptr->code_command ) );
     //адрес для добавления данных с учетом смещения
     dst += OFFSET_CFG_DATA;
     //добавляем данные с учетом смещения
@@ -582,64 +1432,276 @@ static ZBErrorState SetCfg( void *ptr ) {
     dst += sizeof( zb_cfg );
     //добавляем код завершения команды с учетом добавленных данных
     *dst = *( zc_ptr->code_command + sizeof( zc_ptr->code_command ) - 1 );
-    //передача данных
-    state = SendData( zc_ptr->id_command, buff_data, sizeof( zc_ptr->code_command ) + sizeof( zb_cfg ), zc_ptr->time_answer );
-    ZBIncError( state );
-    return state;
+    return sizeof( zc_ptr->code_command ) + sizeof( zb_cfg );
  }
 
 //*************************************************************************************************
-// Формирование и отправка пакета данных конкретному уст-ву.
+// Асинхронная передача пакета уст-ву с формированием пакета непосредственно в ячейке пула 
+// запросов (без промежуточного буфера и копирования). Параметры пакета - см. CreatePack().
 //-------------------------------------------------------------------------------------------------
-// uint8_t *data       - указатель на передаваемые данные
-// uint8_t len         - размер передаваемых данных
-// uint16_t time_answ  - время ожидания ответа
-// return ZBErrorState - результат передачи данных
+// ZBTypePack type         - тип формируемого пакета
+// uint16_t dev_numb       - номер уст-ва
+// uint8_t count_log       - кол-во запрашиваемых записей (только для ZB_PACK_REQ_DATA)
+// ValveCtrlMode cold      - команда управления электроприводом крана холодной воды
+// ValveCtrlMode hot       - команды управления электроприводом крана горячей воды
+// uint16_t time_answ      - время ожидания ответа (msec), TIME_NO_WAIT - без ожидания ответа,
+//                           TIME_WAIT_RTO - по оценке времени ответа уст-ва
+// ZBSendCallBack callback - функция завершения запроса (может быть NULL)
+// void *arg               - параметр функции завершения запроса
+// return ZBErrorState     - ZB_ERROR_OK - запрос добавлен в очередь, ZB_ERROR_NUMB - пакет
+//                           не сформирован (уст-ва нет в списке), иначе ошибка
+//*************************************************************************************************
+ZBErrorState ZBSendCreate( ZBTypePack type, uint16_t dev_numb, uint8_t count_log, ValveCtrlMode cold, ValveCtrlMode hot, uint16_t time_answ, ZBSendCallBack callback, void *arg ) {
+
+    uint8_t ind, len;
+    uint16_t net_addr;
+
+    //свободная ячейка пула запросов
+    if ( osMessageQueueGet( msg_send_free, &ind, NULL, 0 ) != osOK ) {
+        ZBIncError( ZB_ERROR_BUSY );
+        return ZB_ERROR_BUSY;
+       }
+    //пакет формируется сразу в ячейке после заголовка
+    len = EncodePack( send_req[ind].frame + SEND_FRAME_HEAD, SEND_DATA_SIZE, type, dev_numb, &net_addr, count_log, cold, hot );
+    if ( !len ) {
+        osMessageQueuePut( msg_send_free, &ind, 0, 0 );
+        return ZB_ERROR_NUMB;
+       }
+    return SendPost( ind, len, net_addr, time_answ, callback, arg );
+ }
+
 //*************************************************************************************************
-ZBErrorState ZBSendPack1( uint8_t *data, uint8_t len, uint16_t addr, uint16_t time_answ ) {
+// Функция завершения запроса для ZBControl(): сохраняет результат и снимает ожидание задачи
+//-------------------------------------------------------------------------------------------------
+// ZBErrorState state - результат выполнения запроса
+// void *arg          - указатель на параметры синхронного запроса SEND_SYNC
+//*************************************************************************************************
+static void SendSync( ZBErrorState state, void *arg ) {
 
-    ZBErrorState state;
-    uint8_t *dst, *addr8; 
-    uint8_t command[] = { ZB_SEND_DATA, 0x00, ZB_ONDEMAND, ZB_ONDEMAND_ADDRESS };
+    SEND_SYNC *sync = (SEND_SYNC *)arg;
 
-    //проверка: адреса получателя/размера передаваемых данных
-    if ( len > ( sizeof( buff_data ) - sizeof( command ) ) ) {
-        ZBIncError( ZB_ERROR_DATA );
-        return ZB_ERROR_DATA;
+    sync->state = state;
+    osThreadFlagsSet( sync->thread, FLAG_SEND_SYNC );
+ }
+
+//*************************************************************************************************
+// Заполнение заголовка пакета передачи данных уст-ву в ячейке пула запросов, параметров
+// запроса и добавление запроса в очередь msg_send класса запроса. Данные пакета уже 
+// размещены в ячейке. Запросам класса ZB_CLASS_BULK не доступны последние SEND_REQ_RESERVE
+// свободных ячеек пула, они остаются для запросов управления и опроса.
+//-------------------------------------------------------------------------------------------------
+// uint8_t ind             - индекс ячейки пула запросов
+// uint8_t len             - размер данных пакета
+// uint16_t addr           - адрес уст-ва в сети
+// uint16_t time_answ      - время ожидания ответа (msec)
+// ZBSendCallBack callback - функция завершения запроса
+// void *arg               - параметр функции завершения запроса
+// return ZBErrorState     - результат добавления запроса в очередь, при ошибке ячейка 
+//                           возвращается в пул
+//*************************************************************************************************
+static ZBErrorState SendPost( uint8_t ind, uint8_t len, uint16_t addr, uint16_t time_answ, ZBSendCallBack callback, void *arg ) {
+
+    SEND_REQ *req;
+
+    req = &send_req[ind];
+    //заголовок: команда передачи, размер блока данных, режим передачи, адрес получателя
+    req->frame[0] = ZB_SEND_DATA;
+    req->frame[OFFSET_DATA_SIZE] = len + ZB_MODE_SIZE + ZB_ADDR_SIZE;
+    req->frame[2] = ZB_ONDEMAND;
+    req->frame[3] = ZB_ONDEMAND_ADDRESS;
+    req->frame[4] = addr >> 8;
+    req->frame[5] = addr & 0xFF;
+    req->len = len;
+    req->size = len + SEND_FRAME_HEAD;
+    req->sys = ZB_ANS_UNDEF;
+    req->addr = addr;
+    req->time_answ = time_answ;
+    req->tries = 0;
+    req->retry = false;
+    req->queued = false;
+    req->callback = callback;
+    req->arg = arg;
+    //ключ сопоставления ответа с запросом
+    req->answ = CheckPackAnsw( req->frame + SEND_FRAME_HEAD, len, &req->dev_numb );
+    req->follow = false;
+    req->next = SEND_REQ_NONE;
+    //такой же запрос уже выполняется: ожидаем его ответ без повторной передачи
+    if ( SendAttach( ind ) == true )
+        return ZB_ERROR_OK;
+    req->cls = SendClass( req );
+    if ( req->cls == ZB_CLASS_BULK && osMessageQueueGetCount( msg_send_free ) < SEND_REQ_RESERVE ) {
+        osMessageQueuePut( msg_send_free, &ind, 0, 0 );
+        ZBIncError( ZB_ERROR_BUSY );
+        return ZB_ERROR_BUSY;
+       }
+    req->time_post = osKernelGetTickCount();
+    req->used = true;
+    osMessageQueuePut( msg_send[req->cls], &ind, 0, 0 );
+    osEventFlagsSet( zb_ctrl, EVN_ZC_SEND_REQ );
+    return ZB_ERROR_OK;
+ }
+
+//*************************************************************************************************
+// Присоединение запроса только на чтение (ZB_PACK_REQ_STATE, ZB_PACK_REQ_VALVE, 
+// ZB_PACK_REQ_DATA текущих данных) к такому же выполняемому запросу тому же уст-ву. 
+// Присоединенный запрос не передается, его функция завершения вызывается с результатом 
+// выполняемого запроса при его завершении (см. SendDone()).
+//-------------------------------------------------------------------------------------------------
+// uint8_t ind   - индекс ячейки пула запросов с новым запросом
+// return = true - запрос присоединен к выполняемому запросу
+//*************************************************************************************************
+static bool SendAttach( uint8_t ind ) {
+
+    uint8_t lead, type;
+    SEND_REQ *req, *ptr;
+
+    req = &send_req[ind];
+    type = req->frame[SEND_FRAME_HEAD];
+    if ( type != ZB_PACK_REQ_STATE && type != ZB_PACK_REQ_VALVE && type != ZB_PACK_REQ_DATA )
+        return false;
+    if ( req->answ == ZB_PACK_UNDEF || req->answ == ZB_PACK_WLOG || !req->time_answ )
+        return false; //запрос журнальных данных или без ожидания ответа
+    osKernelLock();
+    for ( lead = 0; lead < SEND_REQ_CNT; lead++ ) {
+        ptr = &send_req[lead];
+        if ( ptr->used == false || ptr->follow == true || ptr->sys != ZB_ANS_UNDEF || !ptr->time_answ )
+            continue;
+        if ( ptr->frame[SEND_FRAME_HEAD] != type || ptr->answ != req->answ || ptr->dev_numb != req->dev_numb )
+            continue;
+        //добавляем запрос в цепочку присоединенных запросов
+        req->follow = true;
+        req->next = ptr->next;
+        ptr->next = ind;
+        osKernelUnlock();
+        stat_cnt[ZB_STAT_COALESCED]++;
+        return true;
+       }
+    osKernelUnlock();
+    return false;
+ }
+
+//*************************************************************************************************
+// Определение класса приоритета запроса по типу передаваемого пакета
+//-------------------------------------------------------------------------------------------------
+// SEND_REQ *req      - запрос
+// return ZBSendClass - класс приоритета запроса
+//*************************************************************************************************
+static ZBSendClass SendClass( SEND_REQ *req ) {
+
+    if ( req->sys != ZB_ANS_UNDEF || req->frame[SEND_FRAME_HEAD] == ZB_PACK_CTRL_VALVE )
+        return ZB_CLASS_CTRL;
+    if ( SendIsAck( req ) == true || req->answ == ZB_PACK_WLOG || req->answ == ZB_PACK_WLOG_SEQ || req->answ == ZB_PACK_WLOG_BATCH )
+        return ZB_CLASS_BULK;
+    return ZB_CLASS_QUERY;
+ }
+
+//*************************************************************************************************
+// Проверка запроса на подтверждение получения журнальных данных. Подтверждения передаются
+// в классе ZB_CLASS_BULK, но ограничителем скорости класса не учитываются: поток подтверждений
+// определяется потоком журнальных данных от уст-в, а задержка подтверждения ограничителем 
+// снижает скорость передачи журнала (один пакет данных на одно подтверждение/окно).
+//-------------------------------------------------------------------------------------------------
+// SEND_REQ *req - запрос
+// return = true - запрос является подтверждением
+//*************************************************************************************************
+static bool SendIsAck( SEND_REQ *req ) {
+
+    return req->frame[SEND_FRAME_HEAD] == ZB_PACK_ACK || req->frame[SEND_FRAME_HEAD] == ZB_PACK_ACK_WIN;
+ }
+
+//*************************************************************************************************
+// Пополнение ограничителя скорости передачи и получение разрешения на передачу пакета.
+// Пакет, размер которого превышает емкость ограничителя, передается при полном запасе.
+// Вызов выполняется только при установленной блокировке доступа к модулю zb_mutex
+//-------------------------------------------------------------------------------------------------
+// uint8_t ind - индекс ограничителя (класс запроса/ZB_RATE_BCAST)
+// uint8_t len - размер данных пакета
+// return = 0  - передача разрешена, запас ограничителя уменьшен
+//        > 0  - время до пополнения ограничителя (msec)
+//*************************************************************************************************
+static uint32_t RateTake( uint8_t ind, uint8_t len ) {
+
+    RATE_BUCKET *bkt;
+    uint32_t tick, time, wait, rate_b, rate_f, need_b;
+
+    bkt = &rate_bkt[ind];
+    rate_b = ZBRateBytes( ind );
+    rate_f = ZBRateFrames( ind );
+    //пополнение запаса за время с последнего пополнения (не более емкости)
+    tick = osKernelGetTickCount();
+    time = tick - bkt->tick;
+    bkt->tick = tick;
+    if ( time > 1000 )
+        time = 1000;
+    bkt->bytes += time * rate_b;
+    if ( bkt->bytes > rate_b * 1000 )
+        bkt->bytes = rate_b * 1000;
+    bkt->frames += time * rate_f;
+    if ( bkt->frames > rate_f * 1000 )
+        bkt->frames = rate_f * 1000;
+    need_b = len * 1000;
+    if ( need_b > rate_b * 1000 )
+        need_b = rate_b * 1000;
+    if ( bkt->bytes >= need_b && bkt->frames >= 1000 ) {
+        bkt->bytes -= need_b;
+        bkt->frames -= 1000;
+        return 0;
        }
+    //время до пополнения запаса
+    wait = 1;
+    if ( bkt->bytes < need_b )
+        wait = ( need_b - bkt->bytes + rate_b - 1 ) / rate_b;
+    if ( bkt->frames < 1000 && ( 1000 - bkt->frames + rate_f - 1 ) / rate_f > wait )
+        wait = ( 1000 - bkt->frames + rate_f - 1 ) / rate_f;
+    return wait;
+ }
+
+//*************************************************************************************************
+// Проверка готовности ZigBee модуля к передаче пакетов данных уст-вам
+//-------------------------------------------------------------------------------------------------
+// return ZBErrorState - ZB_ERROR_OK - модуль готов к передаче
+//*************************************************************************************************
+static ZBErrorState SendReady( void ) {
+
     //проверка включенного ZigBee модуля
-    if ( DevStatus( ZB_STATUS_RUN ) == ERROR ) {
-        ZBIncError( ZB_ERROR_RUN );
+    if ( DevStatus( ZB_STATUS_RUN ) == ERROR )
         return ZB_ERROR_RUN;
-       }
     //проверка наличия сети ZigBee модуля
-    if ( zb_cfg.nwk_state == ZB_NETSTATE_NO ) {
-        ZBIncError( ZB_ERROR_NETWORK );
+    if ( zb_cfg.nwk_state == ZB_NETSTATE_NO )
         return ZB_ERROR_NETWORK;
+    return ZB_ERROR_OK;
+ }
+
+//*************************************************************************************************
+// Пакетная передача запросов из очереди tx_ring без ожидания ответа. Пакеты с заголовком 
+// передаются по DMA непосредственно из ячеек пула запросов, передача следующего пакета 
+// запускается из прерывания завершения передачи предыдущего (ZBSendComplt()), задача 
+// ожидает только завершение передачи всей очереди.
+// Вызов выполняется только при установленной блокировке доступа к модулю zb_mutex
+//-------------------------------------------------------------------------------------------------
+// return - кол-во переданных пакетов из очереди
+//*************************************************************************************************
+static uint8_t SendChain( void ) {
+
+    uint8_t sent;
+    SEND_REQ *req;
+    
+    GetAnswer();
+    #if ( DEBUG_ZIGBEE == 1 ) && defined( DEBUG_TARGET )
+    for ( sent = 0; sent < tx_cnt; sent++ ) {
+        req = &send_req[tx_ring[sent]];
+        SendDebug( ZB_DEBUG_TX, req->frame, req->size );
        }
-    send_cnt++; //подсчет отправленных пакетов
-    //ставим блокировку доступа к ZigBee модулю
-    osMutexAcquire( zb_mutex, osWaitForever );
-    //подготовка пакета
-    dst = buff_data;
-    memset( buff_data, 0x00, sizeof( buff_data ) );
-    //копируем в буфер команду
-    memcpy( buff_data, command, sizeof( command ) );
-    //смещение для добавления адреса получателя
-    dst += sizeof( command );
-    //адрес получателя
-    addr8 = (uint8_t *)&addr;
-    *dst++ = *( addr8 + 1 );
-    *dst++ = *addr8;
-    //добавляем данные
-    memcpy( dst, data, len );
-    //корректируем параметр "размер блока данных"
-    *( buff_data + OFFSET_DATA_SIZE ) = len + ZB_MODE_SIZE + ZB_ADDR_SIZE;
-    state = SendData( ZB_CMD_SEND_DATA, buff_data, len + sizeof( command ) + ZB_ADDR_SIZE, time_answ );
-    ZBIncError( state );
-    //передача завершена, снимаем блокировку доступа к ZigBee модулю
-    osMutexRelease( zb_mutex );
-    return state;
+    #endif
+    osEventFlagsSet( chk_event, EVN_LED_ZB_ACTIVE );
+    tx_done = 0;
+    req = &send_req[tx_ring[0]];
+    if ( HAL_UART_Transmit_DMA( &huart3, req->frame, req->size ) == HAL_OK )
+        osSemaphoreAcquire( sem_send, osWaitForever ); //ждем завершение передачи очереди
+    sent = tx_done;
+    tx_cnt = 0;
+    send_cnt += sent; //подсчет отправленных пакетов
+    return sent;
  }
 
 //*************************************************************************************************
@@ -670,9 +1732,16 @@ ZBErrorState ZBSendPack( uint8_t *data, uint8_t len ) {
         ZBIncError( ZB_ERROR_NETWORK );
         return ZB_ERROR_NETWORK;
        }
-    send_cnt++; //подсчет отправленных пакетов
     //ставим блокировку доступа к ZigBee модулю
     osMutexAcquire( zb_mutex, osWaitForever );
+    //ограничение скорости широковещательной передачи
+    if ( RateTake( ZB_RATE_BCAST, len ) ) {
+        stat_cnt[ZB_STAT_RATE_REJECT]++;
+        osMutexRelease( zb_mutex );
+        ZBIncError( ZB_ERROR_BUSY );
+        return ZB_ERROR_BUSY;
+       }
+    send_cnt++; //подсчет отправленных пакетов
     //подготовка пакета
     dst = buff_data;
     memset( buff_data, 0x00, sizeof( buff_data ) );
@@ -709,19 +1778,17 @@ static ZBErrorState SendData( ZBCmnd cmnd, uint8_t *data, uint8_t len, uint16_t
     osStatus_t state_sem;
     
     GetAnswer();
-    ClearRecv();
     //проверка параметров вызова
-    if ( data == NULL || len > sizeof( send_buff ) )
+    if ( data == NULL || !len )
         return ZB_ERROR_DATA;
-    //копируем в буфер данные
-    memset( send_buff, 0x00, sizeof( send_buff ) );
-    memcpy( send_buff, data, len );
     #if ( DEBUG_ZIGBEE == 1 ) && defined( DEBUG_TARGET )
     SendDebug( ZB_DEBUG_TX, data, len );
     #endif
     osEventFlagsSet( chk_event, EVN_LED_ZB_ACTIVE );
     //передача данных
-    if ( HAL_UART_Transmit_DMA( &huart3, send_buff, len ) == HAL_OK )
+    //данные передаются по DMA из буфера вызывающей функции без копирования, 
+    //буфер не изменяется до завершения передачи (ожидание sem_send)
+    if ( HAL_UART_Transmit_DMA( &huart3, data, len ) == HAL_OK )
         osSemaphoreAcquire( sem_send, osWaitForever ); //ждем завершение передачи данных
     else return ZB_ERROR_SEND;
     state = ZB_ERROR_OK;
@@ -778,10 +1845,10 @@ static ZBErrorState GetAnswer( void ) {
 // Проверка выполняется сравнением по данным массива zb_answr[]
 //-------------------------------------------------------------------------------------------------
 // uint8_t *answer - указатель на буфер с ответом
-// uint8_t len     - размер ответа в байтах
+// uint16_t len    - размер ответа в байтах (блок пакетов может быть больше 255 байт)
 // return ZBAnswer - код ответа
 //*************************************************************************************************
-static ZBAnswer CheckAnswer( uint8_t *answer, uint8_t len ) {
+static ZBAnswer CheckAnswer( uint8_t *answer, uint16_t len ) {
 
     ZBAnswer answ;
     uint8_t ind, head;
@@ -872,12 +1939,191 @@ void ZBCheckConfig( void ) {
  }
 
 //*************************************************************************************************
-// Обнуление приемного буфера
+// Запуск приема данных по UART3
+// RECV_MODE_DMA = 1 - прием в циклический буфер DMA с контролем паузы на линии (IDLE)
+// RECV_MODE_DMA = 0 - побайтовый прием по прерыванию
+//*************************************************************************************************
+static void StartRecv( void ) {
+
+    #if RECV_MODE_DMA == 1
+    dma_pos = 0;
+    HAL_UARTEx_ReceiveToIdle_DMA( &huart3, dma_buff, sizeof( dma_buff ) );
+    #else
+    HAL_UART_Receive_IT( &huart3, (uint8_t *)&recv, sizeof( recv ) );
+    #endif
+ }
+
+//*************************************************************************************************
+// Потоковый разбор принятых данных с размещением в текущей ячейке пула, вызывается только 
+// из прерывания. По первому байту пакета определяется ожидаемый размер пакета, пакет известного 
+// размера завершается сразу после приема последнего байта, без ожидания паузы на линии. 
+// Пакеты, размер которых не известен, завершаются по паузе в приеме (IDLE/TIMER6).
+// Пакет известного размера проверяется (КС/код ответа) до завершения: если проверка не прошла,
+// граница пакета определена неверно (потерян/искажен байт), поэтому остаток блока принимается
+// в эту же ячейку до паузы в приеме и разбирается в RecvFrame() с поиском начала пакета.
+// Ячейка пула занимается при приеме первого байта пакета, если свободной ячейки нет или 
+// пакет не помещается в ячейку - пакет будет отброшен при завершении приема
+//-------------------------------------------------------------------------------------------------
+// uint8_t *data - указатель на принятые данные
+// uint16_t len  - кол-во принятых байт
+//*************************************************************************************************
+static void RecvCopy( uint8_t *data, uint16_t len ) {
+
+    uint16_t part;
+
+    while ( len ) {
+        if ( !recv_ind ) {
+            //первый байт пакета: ожидаемый размер пакета, ячейка пула для приема
+            recv_size = frame_size[*data];
+            if ( recv_cur == RECV_SLOT_NONE && osMessageQueueGet( msg_free, &recv_cur, NULL, 0 ) != osOK ) {
+                recv_cur = RECV_SLOT_NONE;
+                recv_skip = true;
+                stat_cnt[ZB_STAT_POOL_DROP]++;
+               }
+           }
+        //размер пакета известен - копируем только до конца пакета
+        part = len;
+        if ( recv_size && recv_ind + part > recv_size )
+            part = recv_size - recv_ind;
+        if ( recv_skip == false && recv_ind + part > sizeof( recv_slot[0].data ) ) {
+            recv_skip = true;
+            stat_cnt[ZB_STAT_RECV_OVER]++;
+           }
+        if ( recv_skip == false )
+            memcpy( recv_slot[recv_cur].data + recv_ind, data, part );
+        recv_ind += part;
+        data += part;
+        len -= part;
+        //пакет принят полностью, остаток данных - начало следующего пакета
+        if ( recv_size && recv_ind == recv_size ) {
+            if ( recv_skip == true || RecvCheck() == true )
+                RecvClose();
+            else {
+                //завершение пакета по размеру отменяется до паузы в приеме
+                recv_size = 0;
+                stat_cnt[ZB_STAT_MISFRAME]++;
+               }
+           }
+       }
+ }
+
+//*************************************************************************************************
+// Проверка пакета известного размера в текущей ячейке пула перед завершением приема, 
+// вызывается только из прерывания. Системный ответ модуля проверяется по коду ответа, 
+// пакет данных от уст-ва - по контрольной сумме.
+//-------------------------------------------------------------------------------------------------
+// return = true  - пакет подтвержден
+//        = false - размер/КС пакета не подтверждены
+//*************************************************************************************************
+static bool RecvCheck( void ) {
+
+    uint8_t ind, *data;
+
+    data = recv_slot[recv_cur].data;
+    for ( ind = 0; ind < SIZE_ARRAY( zb_answr ); ind++ ) {
+        if ( recv_ind == sizeof( zb_answr[ind].code_answer ) && 
+             memcmp( data, zb_answr[ind].code_answer, sizeof( zb_answr[ind].code_answer ) ) == 0 )
+            return true;
+       }
+    return CheckPackCRC( data, recv_ind ) == SUCCESS;
+ }
+
+//*************************************************************************************************
+// Завершение приема пакета, вызывается только из прерывания.
+// Заполненная ячейка пула передается в TaskZBCtrl() через кольцевой буфер ready_ring[], 
+// следующий пакет принимается в новую ячейку, пока задача обрабатывает предыдущую
 //*************************************************************************************************
-static void ClearRecv( void ) {
+static void RecvClose( void ) {
 
+    uint8_t ready;
+    uint16_t size;
+
+    size = recv_size;
+    recv_size = 0;
+    if ( recv_skip == true ) {
+        //пакет отброшен, ячейка (если была занята) используется для приема следующего пакета
+        stat_cnt[ZB_STAT_FRAME_DROP]++;
+        recv_skip = false;
+        recv_ind = 0;
+        return;
+       }
+    if ( !recv_ind )
+        return;
+    recv_slot[recv_cur].len = recv_ind;
+    //пакет завершен по размеру только после проверки в RecvCheck()
+    recv_slot[recv_cur].checked = ( size && recv_ind == size ) ? true : false;
+    ready_ring[ready_head & ( RECV_SLOT_CNT - 1 )] = recv_cur;
+    ready_head++;
+    //кол-во заполненных ячеек, ожидающих разбора в TaskZBCtrl()
+    ready = (uint8_t)( ready_head - ready_tail );
+    if ( ready > stat_cnt[ZB_STAT_READY_MAX] )
+        stat_cnt[ZB_STAT_READY_MAX] = ready;
+    recv_cur = RECV_SLOT_NONE;
     recv_ind = 0;
-    memset( (uint8_t *)recv_buff, 0x00, sizeof( recv_buff ) );
+    //сообщим в задачу для дальнейшей обработки принятых данных
+    osEventFlagsSet( zb_ctrl, EVN_ZC_RECV_CHECK );
+ }
+
+//*************************************************************************************************
+// Возвращает длительность паузы в приеме, по которой определяется окончание пакета, 
+// расчет выполняется по текущей скорости обмена UART3 и кол-ву байт паузы из config.zb_gap
+//-------------------------------------------------------------------------------------------------
+// return - длительность паузы (мкс)
+//*************************************************************************************************
+uint32_t ZBRecvGap( void ) {
+
+    uint8_t gap;
+    uint32_t byte_time;
+    UARTSpeed speed;
+
+    gap = config.zb_gap;
+    if ( !gap || gap > ZB_GAP_MAX )
+        gap = ZB_GAP_DEFAULT;
+    if ( CheckBaudRate( huart3.Init.BaudRate, &speed ) == SUCCESS )
+        byte_time = UartByteTime( speed );
+    else byte_time = ( 10 * 1000000UL + huart3.Init.BaudRate - 1 ) / huart3.Init.BaudRate;
+    return byte_time * gap;
+ }
+
+//*************************************************************************************************
+// Настройка TIMER6 на длительность паузы окончания пакета для текущей скорости UART3.
+// Частота тактирования TIMER6 = 2 * PCLK1, делитель выбирается для отсчета 1 мкс, 
+// при паузе более 65535 мкс (низкие скорости обмена) делитель увеличивается кратно.
+// В режиме приема по DMA (RECV_MODE_DMA = 1) окончание пакета определяется аппаратно по IDLE
+//*************************************************************************************************
+void ZBRecvTimeout( void ) {
+
+    uint32_t time, scale = 1;
+
+    time = ZBRecvGap();
+    while ( time / scale > 0xFFFF )
+        scale++;
+    __HAL_TIM_DISABLE( &htim6 );
+    htim6.Init.Prescaler = ( HAL_RCC_GetPCLK1Freq() * 2 / 1000000 ) * scale - 1;
+    htim6.Init.Period = time / scale - 1;
+    HAL_TIM_Base_Init( &htim6 );
+ }
+
+//*************************************************************************************************
+// Заполнение таблицы размеров пакетов по значению первого байта пакета для потокового 
+// разбора принимаемых данных: пакеты данных от уст-в (размер по типу пакета), системные 
+// ответы модуля из zb_answr[]. Размер пакетов переменного размера по первому байту не 
+// определяется, такие пакеты завершаются по паузе в приеме. Ответ чтения конфигурации модуля
+// КС не содержит и при приеме не может быть проверен, поэтому также завершается по паузе.
+//*************************************************************************************************
+static void FrameSizeInit( void ) {
+
+    uint8_t head;
+    uint16_t ind;
+
+    //пакеты данных от уст-в
+    for ( ind = 0; ind < SIZE_ARRAY( frame_size ); ind++ ) {
+        head = (uint8_t)ind;
+        frame_size[ind] = CheckPack1( &head, sizeof( head ) );
+       }
+    //системные ответы модуля
+    for ( ind = 0; ind < SIZE_ARRAY( zb_answr ); ind++ )
+        frame_size[zb_answr[ind].code_answer[0]] = sizeof( zb_answr[ind].code_answer );
  }
 
 //*************************************************************************************************
@@ -979,6 +2225,89 @@ char *ZBErrCntDesc( ZBErrorState err_ind, char *str ) {
     return str;
  }
 
+//*************************************************************************************************
+// Возвращает расшифровку и значения дополнительных счетчиков статистики
+//-------------------------------------------------------------------------------------------------
+// ZBStatId stat_ind - индекс счетчика
+// char *str         - указатель для размещения результата
+// return            - указатель на строку с результатом
+//*************************************************************************************************
+char *ZBStatDesc( ZBStatId stat_ind, char *str ) {
+
+    char *ptr;
+    
+    if ( stat_ind >= SIZE_ARRAY( stat_cnt ) )
+        return NULL;
+    PoolUsed();
+    ptr = str;
+    ptr += sprintf( ptr, "%s", stat_descr[stat_ind] );
+    //дополним расшифровку справа знаком "." до 45 символов
+    ptr += AddDot( str, 45, 0 );
+    ptr += sprintf( ptr, "%6u ", stat_cnt[stat_ind] );
+    return str;
+ }
+
+//*************************************************************************************************
+// Возвращает наименование ограничителя скорости передачи
+//-------------------------------------------------------------------------------------------------
+// uint8_t ind - индекс ограничителя (класс запроса/ZB_RATE_BCAST)
+// return      - наименование ограничителя, NULL - индекс за пределами диапазона
+//*************************************************************************************************
+char *ZBRateDesc( uint8_t ind ) {
+
+    if ( ind < SIZE_ARRAY( rate_descr ) )
+        return rate_descr[ind];
+    return NULL;
+ }
+
+//*************************************************************************************************
+// Возвращает ограничение скорости передачи в байтах/сек: из конфигурации или по умолчанию
+//-------------------------------------------------------------------------------------------------
+// uint8_t ind - индекс ограничителя (класс запроса/ZB_RATE_BCAST)
+// return      - ограничение скорости передачи (байт/сек)
+//*************************************************************************************************
+uint16_t ZBRateBytes( uint8_t ind ) {
+
+    if ( ind >= SIZE_ARRAY( rate_bytes ) )
+        return 0;
+    if ( !config.zb_rate_bytes[ind] || config.zb_rate_bytes[ind] > ZB_RATE_BYTES_MAX )
+        return rate_bytes[ind];
+    return config.zb_rate_bytes[ind];
+ }
+
+//*************************************************************************************************
+// Возвращает ограничение скорости передачи в пакетах/сек: из конфигурации или по умолчанию
+//-------------------------------------------------------------------------------------------------
+// uint8_t ind - индекс ограничителя (класс запроса/ZB_RATE_BCAST)
+// return      - ограничение скорости передачи (пакетов/сек)
+//*************************************************************************************************
+uint8_t ZBRateFrames( uint8_t ind ) {
+
+    if ( ind >= SIZE_ARRAY( rate_frames ) )
+        return 0;
+    if ( !config.zb_rate_frames[ind] || config.zb_rate_frames[ind] > ZB_RATE_FRAMES_MAX )
+        return rate_frames[ind];
+    return config.zb_rate_frames[ind];
+ }
+
+//*************************************************************************************************
+// Возвращает кол-во запросов класса в очереди передачи и в ожидании ответа, используется 
+// для передачи фоновых запросов только при отсутствии приоритетных запросов
+//-------------------------------------------------------------------------------------------------
+// ZBSendClass cls - класс запросов
+// return          - кол-во запросов
+//*************************************************************************************************
+uint8_t ZBSendCount( ZBSendClass cls ) {
+
+    uint8_t ind, cnt;
+
+    for ( cnt = 0, ind = 0; ind < SEND_REQ_CNT; ind++ ) {
+        if ( send_req[ind].used == true && send_req[ind].cls == cls )
+            cnt++;
+       }
+    return cnt;
+ }
+
 //*************************************************************************************************
 // Возвращает указатель на строку расшифровки результата выполнения запроса по протоколу 
 //-------------------------------------------------------------------------------------------------
@@ -1038,6 +2367,19 @@ static void ErrorClr( void ) {
 
     recv_cnt = send_cnt = 0;
     memset( (uint8_t *)&error_cnt, 0x00, sizeof( error_cnt ) );
+    memset( (uint8_t *)&stat_cnt, 0x00, sizeof( stat_cnt ) );
+ }
+
+//*************************************************************************************************
+// Обновление счетчиков занятых ячеек пула: текущее и максимальное значение
+//*************************************************************************************************
+static void PoolUsed( void ) {
+
+    if ( msg_free == NULL )
+        return;
+    stat_cnt[ZB_STAT_POOL_USED] = RECV_SLOT_CNT - osMessageQueueGetCount( msg_free );
+    if ( stat_cnt[ZB_STAT_POOL_USED] > stat_cnt[ZB_STAT_POOL_MAX] )
+        stat_cnt[ZB_STAT_POOL_MAX] = stat_cnt[ZB_STAT_POOL_USED];
  }
 
 //*************************************************************************************************
@@ -1097,22 +2439,29 @@ static char *PackDesc( ZBTypePack id_pack ) {
  }
 
 //*************************************************************************************************
-// Вывод отладочной информации при передаче данных в модуль ZigBee
+// Вывод отладочной информации при передаче данных в модуль ZigBee, блок принятых данных
+// выводится строками по DEBUG_LINE байт (размер str2[] ограничен)
 //-------------------------------------------------------------------------------------------------
 // uint8_t *data    - указатель на передаваемые данные пакета
-// uint8_t len_send - размер передаваемых данных
+// uint16_t len     - размер передаваемых данных
 //*************************************************************************************************
-static void SendDebug( ZBDebugMode type, uint8_t *data, uint8_t len ) {
+static void SendDebug( ZBDebugMode type, uint8_t *data, uint16_t len ) {
 
-    uint8_t i;
+    uint16_t i;
     char *ptr;
 
     ptr = str2;
     if ( type == ZB_DEBUG_RX )
         ptr += sprintf( ptr, "RECV: " );
     else ptr += sprintf( ptr, "SEND: " );
-    for ( i = 0; i < len; i++ )
+    for ( i = 0; i < len; i++ ) {
+        if ( i && !( i % DEBUG_LINE ) ) {
+            sprintf( ptr, "\r\n" );
+            UartSendStr( str2 );
+            ptr = str2 + sprintf( str2, "      " );
+           }
         ptr += sprintf( ptr, "%02X ", *data++ );
+       }
     ptr += sprintf( ptr, "\r\n" );
     UartSendStr( str2 );
  }
@@ -7,6 +7,7 @@
 
 #include "water.h"
 #include "valve.h"
+#include "data.h"
 
 #define MAX_NETWORK_PANID           0xFFFE  //максимальный номер сети
 #define MAX_NETWORK_ADDR            0xFFF8  //максимальный адрес уст-ва в сети
@@ -18,8 +19,20 @@
 #define BROADCAST_IDLE_DEV          0xFFFD  //передача для всех простаивающих уст-в в сети (кроме режиме "сон")
 #define BROADCAST_CO_ROUTER_DEV     0xFFFC  //передача для всех координаторов и роутеров 
 
+#define RECV_MODE_DMA               1       //прием по DMA в циклический буфер, окончание пакета 
+                                            //определяется по паузе на линии (IDLE), при значении
+                                            //"0" - побайтовый прием по прерыванию + TIMER6
+
+#define ZB_GAP_DEFAULT              4       //пауза окончания пакета по умолчанию (в байтах),
+                                            //используется только при RECV_MODE_DMA = 0
+#define ZB_GAP_MAX                  32      //максимальная пауза окончания пакета (в байтах)
+
+#define ZB_RATE_BYTES_MAX           10000   //максимальное ограничение скорости передачи (байт/сек)
+#define ZB_RATE_FRAMES_MAX          100     //максимальное ограничение скорости передачи (пакетов/сек)
+
 #define TIME_WAIT_ANSWER            5000    //время ожидания получения данных (msec)
 #define TIME_NO_WAIT                0       //без ожидания проверки отправляемого пакета
+#define TIME_WAIT_RTO               0xFFFF  //время ожидания ответа по оценке времени ответа уст-ва
 
 //Команды управления ZigBee модулем
 typedef enum {
@@ -48,9 +61,58 @@ typedef enum {
                                             //с номеров в настройках контроллера
     ZB_ERROR_ADDR,                          //ошибка адрес уст-ва в полученном пакете не совпадает 
                                             //с адресом в настройках контроллера
+    ZB_ERROR_BUSY,                          //очередь запросов на передачу заполнена
     ZB_ERROR_UNDEF                          //ответ модуля (тип пакета данных) не идентифицирован
  } ZBErrorState;
 
+//Классы приоритета запросов на передачу пакетов уст-вам (в порядке убывания приоритета)
+typedef enum {
+    ZB_CLASS_CTRL,                          //управление электроприводами
+    ZB_CLASS_QUERY,                         //запросы состояния/текущих данных
+    ZB_CLASS_BULK,                          //передача журнальных данных (запросы, подтверждения)
+    ZB_CLASS_CNT                            //кол-во классов
+ } ZBSendClass;
+
+//Индекс ограничителя скорости широковещательной передачи (после ограничителей классов запросов)
+#define ZB_RATE_BCAST               ZB_CLASS_CNT
+
+//Функция завершения асинхронного запроса, вызывается из задачи обмена с ZigBee модулем
+typedef void (*ZBSendCallBack)( ZBErrorState state, void *arg );
+
+//Индексы дополнительных счетчиков статистики обмена
+typedef enum {
+    ZB_STAT_POOL_USED,                      //кол-во занятых ячеек пула принятых пакетов
+    ZB_STAT_POOL_MAX,                       //максимальное кол-во занятых ячеек пула
+    ZB_STAT_POOL_DROP,                      //кол-во потерянных пакетов, нет свободной ячейки пула
+    ZB_STAT_RESYNC,                         //кол-во восстановлений разбора после ошибки в данных
+    ZB_STAT_SKIP_BYTES,                     //кол-во пропущенных байт при поиске начала пакета
+    ZB_STAT_MISFRAME,                       //кол-во пакетов известного размера с ошибкой КС при приеме
+    ZB_STAT_RECV_OVER,                      //кол-во переполнений буфера приема (пакет > BUFF_RECV_SIZE)
+    ZB_STAT_FRAME_DROP,                     //общее кол-во отброшенных при приеме пакетов
+    ZB_STAT_UART_ERROR,                     //кол-во ошибок приема UART (переполнение, ошибка кадра)
+    ZB_STAT_READY_MAX,                      //максимальное кол-во принятых пакетов, ожидающих разбора
+    ZB_STAT_RETRY,                          //кол-во повторных передач запросов
+    ZB_STAT_RETRY_OK,                       //кол-во запросов, выполненных после повторной передачи
+    ZB_STAT_RETRY_BUDGET,                   //кол-во отказов в повторе: исчерпан лимит повторов уст-ва
+    ZB_STAT_RETRY_AIR,                      //кол-во отказов в повторе: превышено эфирное время повторов
+    ZB_STAT_CTRL_SENT,                      //кол-во переданных запросов класса ZB_CLASS_CTRL
+    ZB_STAT_QUERY_SENT,                     //кол-во переданных запросов класса ZB_CLASS_QUERY
+    ZB_STAT_BULK_SENT,                      //кол-во переданных запросов класса ZB_CLASS_BULK
+    ZB_STAT_CTRL_WAIT_MAX,                  //максимальное время ожидания передачи ZB_CLASS_CTRL (ms)
+    ZB_STAT_QUERY_WAIT_MAX,                 //максимальное время ожидания передачи ZB_CLASS_QUERY (ms)
+    ZB_STAT_BULK_WAIT_MAX,                  //максимальное время ожидания передачи ZB_CLASS_BULK (ms)
+    ZB_STAT_CTRL_WAIT_SUM,                  //суммарное время ожидания передачи ZB_CLASS_CTRL (ms)
+    ZB_STAT_QUERY_WAIT_SUM,                 //суммарное время ожидания передачи ZB_CLASS_QUERY (ms)
+    ZB_STAT_BULK_WAIT_SUM,                  //суммарное время ожидания передачи ZB_CLASS_BULK (ms)
+    ZB_STAT_RATE_DEFER,                     //кол-во отложенных передач: превышено ограничение скорости
+    ZB_STAT_RATE_REJECT,                    //кол-во отклоненных передач: превышено ограничение скорости
+    ZB_STAT_COALESCED,                      //кол-во запросов, присоединенных к такому же запросу
+    ZB_STAT_ERR_UNMATCHED,                  //кол-во ответов модуля об ошибке без сопоставления с запросом
+    ZB_STAT_ACK_DEFER,                      //кол-во отложенных подтверждений: нет свободной ячейки пула
+    ZB_STAT_ACK_DROP,                       //кол-во потерянных подтверждений: нет места для отложенных
+    ZB_STAT_CNT                             //кол-во счетчиков
+ } ZBStatId;
+
 //Коды ответов модуля ZigBee (системные ответа)
 typedef enum {
     ZB_ANS_UNDEF,                           //ответ не определен
@@ -159,15 +221,26 @@ typedef struct {
 void ZBInit( void );
 void ZBConfig( void );
 void ZBRecvComplt( void );
+void ZBRecvEvent( uint16_t size );
+void ZBRecvError( void );
 void ZBSendComplt( void );
 void ZBCallBack( void );
+void ZBTimeTick( void );
 void ZBCheckConfig( void );
+void ZBRecvTimeout( void );
+uint32_t ZBRecvGap( void );
 void ZBIncError( ZBErrorState err_ind );
 ZBErrorState ZBControl( ZBCmnd command );
+ZBErrorState ZBControlAsync( ZBCmnd command, ZBSendCallBack callback, void *arg );
 ZBErrorState ZBSendPack( uint8_t *data, uint8_t len );
-ZBErrorState ZBSendPack1( uint8_t *data, uint8_t len, uint16_t addr, uint16_t time_answ );
+ZBErrorState ZBSendCreate( ZBTypePack type, uint16_t dev_numb, uint8_t count_log, ValveCtrlMode cold, ValveCtrlMode hot, uint16_t time_answ, ZBSendCallBack callback, void *arg );
 char *ZBErrCntDesc( ZBErrorState err_ind, char *str );
 uint32_t ZBErrCnt( ZBErrorState err_ind );
 char *ZBErrDesc( ZBErrorState error );
+char *ZBStatDesc( ZBStatId stat_ind, char *str );
+char *ZBRateDesc( uint8_t ind );
+uint16_t ZBRateBytes( uint8_t ind );
+uint8_t ZBRateFrames( uint8_t ind );
+uint8_t ZBSendCount( ZBSendClass cls );
 
 #endif 